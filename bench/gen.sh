@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# gen.sh kind n dir: write a synthetic workload of size n to dir/kind.c
+#
+# kinds:
+#   include  include tree of n headers, each with a guard and a few macros
+#   deep     chain of n headers including the next one
+#   macros   n object-like macros, each used once
+#   nested   function-like macros nested n levels deep
+#   elif     #if/#elif chain with n branches, selected at the last one
+#   skip     n lines in a skipped #if 0 block
+#   line     one line of n tokens passed as a macro argument
+
+kind=$1
+n=$2
+dir=$3
+mkdir -p $dir
+f=$dir/$kind.c
+
+case $kind in
+include | deep)
+    for ((i = 0; i < n; i++)); do
+        {
+            echo "#ifndef H$i"
+            echo "#define H$i"
+            echo "#define V$i $i"
+            if [[ $kind == deep ]] && ((i + 1 < n)); then
+                echo "#include \"h$((i + 1)).h\""
+            fi
+            # binary tree, headers also include their guarded parent
+            for c in $((2 * i + 1)) $((2 * i + 2)) $(((i - 1) / 2)); do
+                if [[ $kind == include ]] && ((c < n)); then
+                    echo "#include \"h$c.h\""
+                fi
+            done
+            echo "int v$i = V$i;"
+            echo "#endif"
+        } > $dir/h$i.h
+    done
+    echo '#include "h0.h"' > $f
+    echo '#include "h0.h"' >> $f
+    ;;
+macros)
+    for ((i = 0; i < n; i++)); do
+        echo "#define M$i ($i + 1)"
+    done > $f
+    for ((i = 0; i < n; i++)); do
+        echo "int m$i = M$i;"
+    done >> $f
+    ;;
+nested)
+    echo "#define F0(x) (x)" > $f
+    for ((i = 1; i < n; i++)); do
+        echo "#define F$i(x) F$((i - 1))(x + $i)"
+    done >> $f
+    for ((i = 0; i < 10; i++)); do
+        echo "int f$i = F$((n - 1))($i);"
+    done >> $f
+    ;;
+elif)
+    echo "#define X $((n - 1))" > $f
+    for ((j = 0; j < 10; j++)); do
+        echo "#if X == 0"
+        echo "int e$j = 0;"
+        for ((i = 1; i < n; i++)); do
+            echo "#elif X == $i"
+            echo "int e$j = $i;"
+        done
+        echo "#endif"
+    done >> $f
+    ;;
+skip)
+    echo "#if 0" > $f
+    for ((i = 0; i < n; i++)); do
+        echo "int s$i = f(\"skipped\", $i) + 'c'; /* comment */"
+    done >> $f
+    echo "#endif" >> $f
+    echo "int s;" >> $f
+    ;;
+line)
+    echo "#define ID(x) x" > $f
+    echo -n "int l[] = {ID(" >> $f
+    for ((i = 0; i < n; i++)); do
+        echo -n "$i + " >> $f
+    done
+    echo "0)};" >> $f
+    ;;
+*)
+    echo "unknown kind: $kind" >&2
+    exit 1
+    ;;
+esac
+echo $f
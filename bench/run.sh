@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# run.sh prep: time prep against gcc -E on synthetic workloads of growing
+# size and on real headers. reports MB/s, tokens/s and peak RSS from -stats,
+# flags kinds whose time grows superlinearly with size, and compares
+# -fconfig with separate runs.
+
+prep=${1:-./prep_bench}
+dir=${BENCH_DIR:-/tmp/prep_bench.$$}
+reps=${BENCH_REPS:-3}
+inc=`gcc -print-file-name=include`
+trap "rm -rf $dir" EXIT
+
+# best wall time in us of reps runs of a command
+best() {
+    local b=0
+    for ((r = 0; r < reps; r++)); do
+        local t0=`date +%s%N`
+        "$@" > /dev/null 2>&1
+        local us=$(((`date +%s%N` - t0) / 1000))
+        ((b == 0 || us < b)) && b=$us
+    done
+    echo $b
+}
+
+# value of the counter named $1 in -stats output $2
+stat() {
+    awk -F '  +' -v n="$1" '$1 == n { print $2 }' <<< "$2"
+}
+
+# prints one row, sets $us to the time of prep
+measure() {
+    local name=$1 file=$2
+    local st=`$prep -stats -I $inc $file 2>&1 > /dev/null`
+    local bytes=`stat "bytes read" "$st"`
+    local toks=`stat tokens "$st"`
+    local rss=`stat "peak rss (kb)" "$st"`
+    us=`best $prep -I $inc $file`
+    local gus=`best gcc -E -P $file`
+    awk -v n="$name" -v b="$bytes" -v t="$toks" -v r="$rss" -v us="$us" \
+        -v g="$gus" \
+        'BEGIN { if (us < 1) us = 1;
+                 printf "%-22s %9.2f %12.0f %8d %10d %7.2f\n", n,
+                        b / us, t / us * 1e6, r, us, us / g }'
+}
+
+printf "%-22s %9s %12s %8s %10s %7s\n" \
+    "workload" "MB/s" "tokens/s" "rss(kb)" "time(us)" "x gcc"
+
+flags=""
+for spec in include:200 deep:40 macros:1000 nested:50 elif:200 skip:5000 line:5000; do
+    kind=${spec%:*}
+    n=${spec#*:}
+    prev=0
+    for m in 1 2 4; do
+        file=`./bench/gen.sh $kind $((n * m)) $dir/$kind$m`
+        measure "$kind n=$((n * m))" $file
+        # doubling the size should at most double the time; allow noise
+        if ((prev > 0 && us > prev * 3 && us > 10000)); then
+            flags="$flags $kind($((n * m / 2))->$((n * m)): ${prev}us->${us}us)"
+        fi
+        prev=$us
+    done
+done
+
+for file in /usr/include/stdio.h /usr/include/stdlib.h prep.c; do
+    measure `basename $file` $file
+done
+
+# -fconfig against one run per configuration
+configs="-DA -DB -DC"
+separate() {
+    for c in $configs; do
+        $prep -I $inc $c prep.c
+    done
+}
+cus=`best $prep -I $inc ${configs//-D/-fconfig=-D} prep.c`
+sus=`best separate`
+awk -v c="$cus" -v s="$sus" \
+    'BEGIN { printf "%-22s %10d us, separate runs %10d us, %5.2fx\n",
+                    "-fconfig x3 prep.c", c, s, s / c }'
+
+if [[ -n $flags ]]; then
+    echo "superlinear:$flags"
+fi
@@ -4,13 +4,32 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/perf_event.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#include <utime.h>
+
+#include "tokstream.h"
 
 typedef enum {
     TK_SPACES,
@@ -23,6 +42,7 @@ typedef enum {
     TK_LITERAL,
     TK_USR_SRC,
     TK_SYSTEM_SRC,
+    TK_VERBATIM, // lines copied as they are, see stmt_verbatim()
     TK_EOF,
 } Kind;
 
@@ -32,6 +52,14 @@ typedef struct _Macro Macro;
 typedef struct _UsedMacro UsedMacro;
 typedef struct _Env Env;
 typedef struct _Predefined Predefined;
+typedef struct _File File;
+typedef struct _Src Src;
+typedef struct _IncKey IncKey;
+typedef struct _IncMemo IncMemo;
+typedef struct _IncRec IncRec;
+typedef struct _Job Job;
+typedef struct _Ckpt Ckpt;
+typedef struct _Incr Incr;
 
 struct _Keyword {
     char *word;
@@ -54,6 +82,24 @@ struct _Macro {
     Token *params;
     Token *to;
     Macro *next;
+    int is_func;
+    char *body;     // unlexed body from the end of name, see macro_prep()
+    char *body_end; // '\n' ending the #define
+    Env *env;       // of #define, to lex body
+    void *snap;     // tokens still in a -include-snapshot file, see snap_prep()
+    Token *def; // name token in #define, for -fmacro-profile
+    Token *memo;          // expansion of object-like macro, see expand_memo()
+    UsedMacro *memo_used; // hideset the memo was expanded under
+    long memo_gen;        // macro_gen of memo
+    long miss_gen;        // macro_gen of last expansion without memo
+    int memo_line;        // memo has __LINE__
+    long calls;
+    long ntoks;
+    double time;
+    int depth;     // expansions of it in progress
+    int max_depth; // deepest expansion frame it was pushed as
+    unsigned long hash; // see macro_hash()
+    int undef;          // tombstone of #undef, see macro_rm()
 };
 
 struct _UsedMacro {
@@ -61,32 +107,324 @@ struct _UsedMacro {
     UsedMacro *next;
 };
 
+struct _File {
+    char *path;
+    int is_sys;
+    unsigned long hash;
+    char *guard; // include guard macro wrapping the whole file
+    int once;    // #pragma once
+    File *next;
+};
+
+struct _Src {
+    // file contents kept over runs (--server), checked by stat per run
+    char *path;
+    char *input;
+    unsigned long hash;
+    int hashed;
+    struct stat st;
+    long run;    // last run that checked st
+    char *guard; // include guard found once
+    Token *toks; // tokens lexed from input, replayed once lexed
+    int *spans;  // offsets in input where lexing of each of toks began/ended
+    int ntoks;
+    int lexed;    // toks are complete, read by workers with __atomic
+    long rec_run; // run recording toks
+    int refs;     // -fincremental states holding it, see incr_hold()
+    int old;      // replaced by a newer read of path
+    int memo;     // read by an include memo, kept with input
+};
+
 struct _Env {
     char *path;
     int skips;
+    int is_sys;
+    File *file;
+    Src *src;
+    int record; // lexed tokens are recorded into src
+    int replay; // tokens come from src instead of lexing
+    int ntok;   // next token to replay
+    int depth;  // nesting of #if in this file
+    int level;  // nesting of #include
+    int items;    // directives and tokens at depth 0
+    Token *guard; // candidate of include guard
     char *input;
+    char *end;    // end of input
+    int *lines;   // offsets of line starts, see token_line()
+    int nlines;
+    IncRec *rec;  // -fconfig: include being recorded
+    int nls;      // newline tokens so far, see ckpt_take()
+    Ckpt *ckpt;   // -fincremental: the including file at the #include
     char *pos;
     Token *cur;
     Env *next;
 };
 
-static void env_push();
+enum { IF_ON, IF_OFF, IF_DONE, IF_DEAD }; // IF_DEAD: #if in skipped region
+
+struct _IncKey {
+    char *key;          // macro name, or '"' and path of a file
+    unsigned long hash; // macro_hash() of the macro or #pragma once of the file
+    Macro *m;           // definition the include left
+    int is_sys;
+    IncKey *next;
+};
+
+struct _IncMemo {
+    int skips;
+    int is_sys;
+    IncKey *deps;  // macros and files looked up before the include changed them
+    IncKey *defs;  // macros and files the include changed
+    Token *first;  // output of the include, up to last
+    Token *last;
+    Token *toks;   // first..last in order, copied by inc_replay()
+    int ntoks;
+    Src **srcs;    // files read, the memo is stale when one changed
+    int nsrcs;
+    int *dead;     // set when the run recording it was discarded
+    IncMemo *next; // of the same path
+};
+
+struct _Job {
+    // -fparallel-includes: include redone by a worker thread
+    char *path;
+    int skips;
+    int is_sys;
+    IncMemo *pred;  // stale memo whose lookups and changes are predicted
+    Macro *macros;  // definitions at the include, copied
+    File *files;    // files at the include, copied
+    IncMemo *memo;  // result, NULL on errors
+    Token *at;      // output of this thread the result is spliced after
+    pthread_t th;
+    Job *next;
+};
+
+struct _Ckpt {
+    // -fincremental: state of a run at a directive, a line or the start of
+    // a file, see ckpt_take()
+    Env env;      // copy of the file being read
+    Token cur;    // copy of its next token
+    int off;      // end of cur in env.input, where lexing goes on
+    Ckpt *up;     // the including file at the #include, as env.ckpt
+    Macro *macro; // kept intact by macro_rm()
+    unsigned long mstate; // macro table version, see ckpt_fold()
+    unsigned long fstate; // files opened, in order
+    unsigned long ostate; // files with #pragma once, in order
+    int nfiles;
+    int nonces;
+    char *conds;
+    int nconds;
+    Token *ocur; // output so far
+    Ckpt *all;   // next one allocated for the same Incr
+};
+
+typedef struct _Frame Frame;
+struct _Frame {
+    Macro *m;
+    Token *inv;  // macro name of the invocation
+    int is_func;
+    int is_memo; // replacement is a copy of m->memo
+    int in_args; // args are expanded before the replacement
+    Token head;  // replacement being rescanned
+    Token *prev; // last token expanded
+    Token *t;    // next token to expand
+    Token *end;  // token after ')' of the invocation
+    double ts;   // for -fmacro-profile
+    int depth;   // frames up to this one
+    Frame *next; // enclosing expansion, or next free frame
+};
+
+static void env_push(char *path, int skips, int is_sys);
 static void env_pop();
 static Token *expand_macro(Token **saddr);
 static Token *expand_recursive(Token **saddr);
-static Token *expand_obj(Token **saddr, Macro *macro);
-static Token *expand_func(Token **saddr, Macro *macro);
 static int expr();
-static void stmt(int is_top);
-static void stmt_off();
+static void stmt();
+static void drc_include_end();
+static void inc_consult(char *key, int len);
+static void inc_own(char *key, int len);
+static void snap_prep(Macro *m);
 
 struct IncDir {
     char *dir[100];
     int len;
+    int nuser; // number of leading dirs given by -I
 } incdir = {{"/usr/include/", "/usr/include/x86_64-linux-gnu/",
              "/usr/local/include/",
              "/usr/lib/gcc/x86_64-linux-gnu/13/include/"},
-            4};
+            4, 0};
+
+struct Opts {
+    int deps;      // 1: -M/-MD, 2: -MM/-MMD (user headers only)
+    int deps_only; // -M/-MM: no output, only directives are processed
+    char *deps_file;
+    char *deps_target;
+    char *cache_dir; // -fcache-dir: on-disk output cache
+    long cache_size; // -fcache-size: limit of cache dir in bytes
+    int stats;       // -stats: print counters on exit
+    char *snapshot_out; // -fsnapshot: write macro table after processing
+    char *snapshot_in;  // -include-snapshot: start from written macro table
+    char *prefix;       // header to process before main file
+    char *output;       // -o
+    char *server;       // --server: socket to serve requests
+    char *client;       // --client: socket to forward request
+    int warm;           // keep lexed tokens over runs
+    int watch;          // --watch: rebuild outputs on changes
+    char *time_trace;   // -ftime-trace: write chrome trace events
+    long time_trace_granularity; // us, shorter expansions are not traced
+    int macro_profile;  // -fmacro-profile: print top n macros by time
+    int perf_counters;  // -fperf-counters: print hw counters per phase
+    int max_include_depth;
+    int compact;        // -fcompact: minimal whitespace, no empty lines
+    int line_markers;   // -fline-markers: # line markers in -fcompact
+    int token_stream;   // -ftoken-stream: binary tokens, see tokstream.h
+    char **defs;        // -D/-U as "Dname=value" or "Uname", in order
+    int ndefs;
+    char **configs;     // -fconfig: options of each configuration
+    int nconfigs;
+    int parallel_includes; // -fparallel-includes: worker threads
+    int incremental;    // -fincremental: resume the last run at an edit
+} opts = {.cache_size = 64 << 20,
+           .time_trace_granularity = 500,
+           .max_include_depth = 200};
+
+struct Stats {
+    long cache_hit;
+    long cache_miss;
+    long files_read;  // read_file()
+    long bytes_read;
+    long tokens;      // token_new() and token_dup()
+    long tok_replays; // tokens replayed from an earlier run
+    long lookups;     // macro_get()
+    long lookup_walk; // macros compared in macro_get()
+    long defines;
+    long undefs;
+    long expand_obj;
+    long expand_func;
+    long memo_hits;   // object expansions copied from memo
+    long used_nodes;  // UsedMacro allocated
+    long probes;      // inc_access() calls from inc_path_find()
+    long accesses;    // access() calls
+    long skip_lines;  // lines in skipped regions
+    long verbatim_lines; // lines copied, or skipped by -M, without tokens
+    long inc_replays;    // includes replayed from recorded ones
+    long inc_jobs;       // includes given to -fparallel-includes workers
+    long inc_job_fails;  // worker results that did not match
+    long ckpts;          // checkpoints taken
+    long ckpt_reused;    // checkpoints of the last run kept
+    long out_bytes;
+} __thread stats = {0};
+
+struct Buf {
+    char *data;
+    int len;
+    int cap;
+} out = {0}; // output text
+
+struct Arena {
+    // tokens, hidesets and macros of a run, see prep_reset()
+    char *chunk; // starts with the previous chunk
+    long used;
+    long cap;
+} __thread arena = {0};
+#define ARENA_CHUNK (1 << 20)
+
+struct Trace {
+    int on;
+    int depth;     // include nesting
+    int skipping;  // in skipped region
+    int expanding; // in top-level expand_macro()
+    struct Buf buf;
+} __thread trace = {0};
+
+enum { PH_DIRECTIVE, PH_LEX, PH_EXPAND, PH_OUTPUT, PH_N };
+#define PERF_NCTR 4 // cycles, instructions, cache misses, branch misses
+
+struct Perf {
+    int on;
+    int fd;                // group leader
+    int n;                 // counters opened
+    int slot[PERF_NCTR];   // counter of each value in the group
+    struct perf_event_mmap_page *pc[PERF_NCTR]; // of each value, for rdpmc
+    int phase;             // phase charged for counts since last switch
+    unsigned long last[PERF_NCTR];
+    unsigned long sum[PH_N][PERF_NCTR];
+} __thread perf = {0};
+
+typedef struct {
+    char **keys;
+    void **vals;
+    int cap;
+    int len;
+} Map;
+
+typedef struct {
+    char *path;
+    struct timespec mtime;
+    long gen; // bumped when entries of dir changed
+    long run;
+} ProbeDir;
+
+typedef struct {
+    ProbeDir *dir;
+    long gen;
+    int ok;
+} Probe;
+
+struct _Incr {
+    // -fincremental: last run of a file with the same options
+    int ok;       // the run completed
+    int partial;  // a file was read without checkpoint at its start
+    Token head;   // output
+    Token *last;
+    Ckpt **cps;   // in order of the run
+    int ncps;
+    Map srcs;     // path => Src read
+    char **onces; // paths in order of #pragma once
+    int nonces;
+    File *files;
+    Ckpt *all;    // every checkpoint allocated, see incr_clear()
+    Src **olds;   // files replaced in srcs, read by the output
+    int nolds;
+    int resumes;  // since the last full run
+    long used;    // run, for eviction
+};
+
+struct Ckpts {
+    int on; // taking checkpoints into ir
+    Incr *ir;
+    Macro *folded; // macro when mstate was computed
+    unsigned long mstate;
+    unsigned long fstate;
+    unsigned long ostate;
+    int nfiles;
+    // resuming after olds became news: bytes [pre, oldend) of olds were
+    // replaced and the rest moved by delta
+    Src *olds;
+    Src *news;
+    int pre;
+    int oldend;
+    int delta;
+    int lines;     // the edit kept the number of lines
+    Ckpt **old;    // checkpoints of the last run after the resumed one
+    int nold;
+    int *same;     // next old one at the same position
+    Map index;     // position => old checkpoint, see ckpt_match()
+    Ckpt *from;    // resumed one
+    Token *at;     // its cur, not taken again
+    Token *rest;   // output after from->ocur in the last run
+    Token *last;   // end of the output of the last run
+    File *ofiles;  // files opened after from in the last run
+    char **oonces; // #pragma once after from in the last run
+    int noonces;
+    int keep;      // checkpoints before the resumed run's ones
+    int tail;      // first of old kept after them
+    int done;      // converged, see ckpt_converge()
+} __thread ckpts = {0};
+#define CKPT_LINES 64 // newlines between checkpoints without directives
+#define INCR_RESUMES 64 // resumes before a full run frees their garbage
+#define INCR_MAX 16     // files with checkpoints kept, least recent evicted
+Map incrs = {0}; // key of file and options => Incr
 
 struct _Predefined {
     Kind id;
@@ -102,13 +440,34 @@ struct _Predefined {
     {TK_EOF, NULL, NULL},
 };
 
-char *pos = NULL;        // position in input strings
-Token *cur = NULL;       // current input token
-Token *ocur = NULL;      // output token list
-Token *macro_org = NULL; // keep original macro for expansion
-Env *env = NULL;     // environment having file, input string, pos, cur, etc.
-Macro *macro = NULL; // keep defined macro
+// state of a run is per thread, -fparallel-includes workers have their own
+__thread char *pos = NULL;        // position in input strings
+__thread Kind preid = TK_NEWLINE; // kind of last lexed token
+__thread Token *cur = NULL;       // current input token
+__thread Token *ocur = NULL;      // output token list
+__thread Token *macro_org = NULL; // keep original macro for expansion
+__thread Env *env = NULL; // environment having file, input string, pos, etc.
+__thread Macro *macro = NULL; // keep defined macro
+__thread long macro_gen = 0;  // bumped on every change of macro definitions
+#define BLOOM_SIZE (1 << 16)
+__thread unsigned short bloom[BLOOM_SIZE]; // counting filter of macro names
+__thread File *files = NULL; // every file opened, in order of first opening
+__thread Macro **profs = NULL; // macros expanded in this run
+__thread Frame *frames = NULL; // macro expansions in progress, innermost first
+__thread Frame *frees = NULL;  // frames to reuse
+__thread char *conds = NULL;   // state of open #if, innermost last
+__thread int nconds = 0;
+__thread int nprofs = 0;
+__thread int errfd = 2;           // messages go here
+__thread jmp_buf *recover = NULL; // errors jump here instead of exit
 Keyword *keyword = NULL; // keyword strings used for parsing input strings
+Map srcs = {0};          // path => Src
+Map probes = {0};        // path => Probe, result of access() in include dirs
+Map probedirs = {0};     // dir => ProbeDir
+Map missing = {0};       // paths probed in vain this run, for cache_store()
+pthread_mutex_t shared; // srcs, probes, probedirs, see main()
+long run = 0;            // count of preprocessing runs in this process
+char *cwd = NULL;
 
 static int scmp(char *p, int len, char *s) {
     return len == strlen(s) && strncmp(p, s, len) == 0;
@@ -116,10 +475,25 @@ static int scmp(char *p, int len, char *s) {
 
 static char *mk_path(char *buf, char *dir, char *fname) {
     char *path = realloc(buf, sizeof(char) * (strlen(dir) + strlen(fname)) + 2);
-    sprintf(path, "%s/%s", dir, fname);
+    int len = strlen(dir);
+    sprintf(path, "%s%s%s", dir, len && dir[len - 1] == '/' ? "" : "/", fname);
     return path;
 }
 
+#define HASH_INIT 0xcbf29ce484222325UL
+
+static unsigned long hash_bytes(unsigned long h, char *p, int len) {
+    // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)p[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+static unsigned long hash_str(unsigned long h, char *s) {
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
 static int linenum(Token *at) {
     int lnnum = 1;
     for (char *p = at->env->input; p < at->pos; p++) {
@@ -143,15 +517,17 @@ static void exit_if(int c, Token *t, char *msg, ...) {
         char *lne = strchr(t->pos, '\n');
         lne = lne ? lne : t->pos + strlen(t->pos);
 
-        dprintf(2, "%s %d:%d ", env->path, lnnum, (int)(t->pos - lns));
-        vdprintf(2, msg, ap);
-        dprintf(2, "\n%.*s\n", (int)(lne - lns), lns);
-        dprintf(2, "%*s^", (int)(t->pos - lns - 1), " ");
+        dprintf(errfd, "%s %d:%d ", env->path, lnnum, (int)(t->pos - lns));
+        vdprintf(errfd, msg, ap);
+        dprintf(errfd, "\n%.*s\n", (int)(lne - lns), lns);
+        dprintf(errfd, "%*s^", (int)(t->pos - lns - 1), " ");
     } else {
-        vdprintf(2, msg, ap);
+        vdprintf(errfd, msg, ap);
     }
-    dprintf(2, "\n");
-    if (c != 2) {
+    dprintf(errfd, "\n");
+    if (c != 2 && recover) {
+        longjmp(*recover, 1);
+    } else if (c != 2) {
         exit(EXIT_FAILURE);
     }
 }
@@ -168,14 +544,347 @@ static char *read_file(char *path) {
         buf = realloc(buf, (len + 1) * 2);
     }
     close(fd);
+    stats.files_read++;
+    stats.bytes_read += len;
     return buf;
 };
 
+static void buf_printf(struct Buf *b, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (b->len + n >= b->cap) {
+        b->cap = (b->len + n + 1) * 2;
+        b->data = realloc(b->data, b->cap);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+static void buf_write(struct Buf *b, int fd) {
+    for (int n, len = 0; len < b->len; len += n) {
+        n = write(fd, b->data + len, b->len - len);
+        exit_if(n < 0, NULL, "Can not write output");
+    }
+}
+
+static int buf_add(struct Buf *b, void *p, int len) {
+    if (b->len + len >= b->cap) {
+        b->cap = (b->len + len + 1) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+    return b->len - len;
+}
+
+static double trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void trace_str(char *s, int len) {
+    buf_printf(&trace.buf, "\"");
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char)s[i] < ' ') {
+            buf_printf(&trace.buf, "\\u%04x", s[i]);
+            continue;
+        }
+        if (s[i] == '"' || s[i] == '\\') {
+            buf_printf(&trace.buf, "\\");
+        }
+        buf_printf(&trace.buf, "%c", s[i]);
+    }
+    buf_printf(&trace.buf, "\"");
+}
+
+static void trace_event(char ph, char *name, double ts, Token *at,
+                        char *detail, int len) {
+    buf_printf(&trace.buf, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f",
+               trace.buf.len ? ",\n" : "{\"traceEvents\":[\n", name, ph, ts);
+    if (ph == 'X') {
+        buf_printf(&trace.buf, ",\"dur\":%.3f", trace_now() - ts);
+    }
+    buf_printf(&trace.buf, ",\"pid\":1,\"tid\":1,\"args\":{");
+    if (at) {
+        buf_printf(&trace.buf, "\"file\":");
+        trace_str(at->env->path, strlen(at->env->path));
+        buf_printf(&trace.buf, ",\"line\":%d,\"depth\":%d", linenum(at),
+                   trace.depth);
+    }
+    if (detail) {
+        buf_printf(&trace.buf, "%s\"detail\":", at ? "," : "");
+        trace_str(detail, len);
+    }
+    buf_printf(&trace.buf, "}}");
+}
+
+static void trace_write() {
+    buf_printf(&trace.buf, "%s]}\n", trace.buf.len ? "" : "{\"traceEvents\":[");
+    int fd = open(opts.time_trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    exit_if(fd < 0, NULL, "Can not open file: %s", opts.time_trace);
+    buf_write(&trace.buf, fd);
+    close(fd);
+    trace.buf.len = 0;
+}
+
+static int perf_rdpmc(unsigned long *v) {
+    // counter values without a syscall (seqlock of perf_event_mmap_page),
+    // 0 when one is off the PMU or user space may not read it
+#if defined(__x86_64__) || defined(__i386__)
+    for (int i = 0; i < perf.n; i++) {
+        struct perf_event_mmap_page *pc = perf.pc[i];
+        unsigned int seq;
+        do {
+            if (!pc) {
+                return 0;
+            }
+            seq = pc->lock;
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+            if (!pc->cap_user_rdpmc || !pc->index) {
+                return 0;
+            }
+            int w = 64 - pc->pmc_width;
+            unsigned long pmc = __builtin_ia32_rdpmc(pc->index - 1);
+            v[i] = pc->offset + ((long)(pmc << w) >> w); // sign extended
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } while (pc->lock != seq);
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int perf_switch(int phase) {
+    // charge counts since the last switch to the current phase
+    unsigned long v[1 + PERF_NCTR] = {0};
+    if (perf_rdpmc(v + 1) || read(perf.fd, v, sizeof(v)) > 0) {
+        for (int i = 0; i < perf.n; i++) {
+            perf.sum[perf.phase][perf.slot[i]] += v[1 + i] - perf.last[i];
+            perf.last[i] = v[1 + i];
+        }
+    }
+    int prev = perf.phase;
+    perf.phase = phase;
+    return prev;
+}
+
+static void perf_open() {
+    static int types[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                          PERF_COUNT_HW_CACHE_MISSES,
+                          PERF_COUNT_HW_BRANCH_MISSES};
+    perf.fd = -1;
+    for (int i = 0; i < PERF_NCTR; i++) {
+        struct perf_event_attr a = {0};
+        a.size = sizeof(a);
+        a.type = PERF_TYPE_HARDWARE;
+        a.config = types[i];
+        a.read_format = PERF_FORMAT_GROUP;
+        a.disabled = perf.fd < 0;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &a, 0, -1, perf.fd, 0);
+        if (fd >= 0) {
+            void *pc = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ,
+                            MAP_SHARED, fd, 0);
+            perf.pc[perf.n] = pc == MAP_FAILED ? NULL : pc;
+            perf.fd = perf.fd < 0 ? fd : perf.fd;
+            perf.slot[perf.n++] = i;
+        }
+    }
+    // counters missing in the group are reported as n/a
+    exit_if(2 * (perf.fd < 0), NULL, "perf counters are unavailable");
+    perf.on = perf.fd >= 0;
+    if (perf.on) {
+        ioctl(perf.fd, PERF_EVENT_IOC_ENABLE, 0);
+        perf.phase = PH_DIRECTIVE;
+        perf_switch(PH_DIRECTIVE);
+    }
+}
+
+static void perf_col(int ok, int w, int prec, double v) {
+    if (ok) {
+        dprintf(errfd, " %*.*f", w, prec, v);
+    } else {
+        dprintf(errfd, " %*s", w, "n/a");
+    }
+}
+
+static void perf_print() {
+    static char *phases[] = {"directives", "lex", "expansion", "output"};
+    perf_switch(PH_DIRECTIVE);
+    int has[PERF_NCTR] = {0};
+    for (int i = 0; i < perf.n; i++) {
+        has[perf.slot[i]] = 1;
+    }
+    dprintf(errfd, "%-12s %14s %14s %6s %13s %13s\n", "phase", "cycles",
+            "instructions", "IPC", "cache-miss/k", "branch-miss/k");
+    for (int p = 0; p < PH_N; p++) {
+        unsigned long *s = perf.sum[p];
+        dprintf(errfd, "%-12s", phases[p]);
+        perf_col(has[0], 14, 0, s[0]);
+        perf_col(has[1], 14, 0, s[1]);
+        perf_col(has[0] && has[1] && s[0], 6, 2, (double)s[1] / s[0]);
+        // misses per 1000 instructions
+        perf_col(has[1] && has[2] && s[1], 13, 2, s[2] * 1e3 / s[1]);
+        perf_col(has[1] && has[3] && s[1], 13, 2, s[3] * 1e3 / s[1]);
+        dprintf(errfd, "\n");
+    }
+    memset(perf.sum, 0, sizeof(perf.sum));
+}
+
+static int map_slot(Map *m, char *key, int len) {
+    int i = hash_bytes(HASH_INIT, key, len) & (m->cap - 1);
+    while (m->keys[i] && !scmp(key, len, m->keys[i])) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+static void *map_get(Map *m, char *key, int len) {
+    return m->cap ? m->vals[map_slot(m, key, len)] : NULL;
+}
+
+static void map_put(Map *m, char *key, int len, void *val) {
+    if (m->len * 2 >= m->cap) {
+        int cap = m->cap ? m->cap * 2 : 64;
+        Map n = {calloc(sizeof(char *), cap), calloc(sizeof(void *), cap), cap};
+        for (int i = 0; i < m->cap; i++) {
+            if (m->keys[i]) {
+                int j = map_slot(&n, m->keys[i], strlen(m->keys[i]));
+                n.keys[j] = m->keys[i];
+                n.vals[j] = m->vals[i];
+                n.len++;
+            }
+        }
+        *m = n;
+    }
+    int i = map_slot(m, key, len);
+    if (!m->keys[i]) {
+        m->keys[i] = strndup(key, len);
+        m->len++;
+    }
+    m->vals[i] = val;
+}
+
+static void src_untok(Src *s) {
+    // forgets the recorded tokens, keeping the arrays
+    for (int i = 0; i < s->ntoks; i++) {
+        free(s->toks[i].leadings);
+    }
+    s->ntoks = 0;
+}
+
+static void src_release(Src *s) {
+    // input and tokens of s once neither srcs nor an Incr refers to it
+    if (s->old && !s->refs && !__atomic_load_n(&s->memo, __ATOMIC_ACQUIRE)) {
+        free(s->input);
+        src_untok(s);
+        free(s->toks);
+        free(s->spans);
+        s->input = NULL;
+        s->toks = NULL;
+        s->spans = NULL;
+    }
+}
+
+static void incr_hold(Incr *ir, Src *s) {
+    // ir refers to s until incr_clear(), and to the one s replaced, whose
+    // tokens stay in the output
+    Src *o = map_get(&ir->srcs, s->path, strlen(s->path));
+    if (o == s) {
+        return;
+    } else if (o) {
+        ir->olds = realloc(ir->olds, sizeof(Src *) * (ir->nolds + 1));
+        ir->olds[ir->nolds++] = o;
+    }
+    s->refs++;
+    map_put(&ir->srcs, s->path, strlen(s->path), s);
+}
+
+static void map_free(Map *m) {
+    // keys and slots of m, not the values
+    for (int i = 0; i < m->cap; i++) {
+        free(m->keys[i]);
+    }
+    free(m->keys);
+    free(m->vals);
+    *m = (Map){0};
+}
+
+static Src *src_get(char *path) {
+    pthread_mutex_lock(&shared);
+    Src *s = map_get(&srcs, path, strlen(path));
+    if (s && s->run == run) {
+        pthread_mutex_unlock(&shared);
+        if (ckpts.on) {
+            incr_hold(ckpts.ir, s);
+        }
+        return s;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        pthread_mutex_unlock(&shared);
+        exit_if(1, cur, "Can not open file: %s", path);
+    }
+    if (!s || s->st.st_dev != st.st_dev || s->st.st_ino != st.st_ino ||
+        s->st.st_size != st.st_size ||
+        s->st.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+        s->st.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+        if (s) {
+            s->old = 1;
+            src_release(s);
+        }
+        s = calloc(sizeof(Src), 1);
+        s->path = strdup(path);
+        s->input = read_file(path);
+        s->st = st;
+        map_put(&srcs, path, strlen(path), s);
+    }
+    s->run = run;
+    pthread_mutex_unlock(&shared);
+    if (ckpts.on) {
+        incr_hold(ckpts.ir, s);
+    }
+    return s;
+}
+
+static unsigned long src_hash(Src *s) {
+    if (!s->hashed) {
+        s->hash = hash_str(HASH_INIT, s->input);
+        s->hashed = 1;
+    }
+    return s->hash;
+}
+
+static File *file_add(char *path, int is_sys) {
+    File **f = &files;
+    while (*f && strcmp((*f)->path, path) != 0) {
+        f = &(*f)->next;
+    }
+    if (!*f) {
+        *f = calloc(sizeof(File), 1);
+        (*f)->path = path;
+        (*f)->is_sys = is_sys;
+        if (ckpts.on) {
+            ckpts.nfiles++;
+            ckpts.fstate = hash_str(ckpts.fstate, path);
+        }
+    }
+    return *f;
+}
+
 static void keywords_init() {
     char *p = "include_next include define undef defined "
               "warinig error ifdef ifndef if else elif endif "
-              ">> << == != <= >= -- ++ && || += -= %= /= *= ## ...";
-    for (; *p; p++) {
+              ">> << == != <= >= -- ++ && || += -= %= /= *= ## ... "
+              "<<= >>= -> &= |= ^=";
+    while (*p) {
         char *ps = p;
         while (*p && *p != ' ') {
             p++;
@@ -184,6 +893,7 @@ static void keywords_init() {
         kw->word = strndup(ps, p - ps);
         kw->next = keyword;
         keyword = kw;
+        p += *p == ' ';
     }
 }
 
@@ -195,8 +905,34 @@ static int is_keyword(char *p, int len) {
     return kw != NULL;
 }
 
+static void *arena_alloc(long size) {
+    // zeroed as by calloc(), freed only with the whole run
+    size = (size + 15) & ~15L;
+    if (arena.used + size > arena.cap) {
+        long cap = size + 16 > ARENA_CHUNK ? size + 16 : ARENA_CHUNK;
+        char *c = calloc(cap, 1);
+        *(char **)c = arena.chunk;
+        arena = (struct Arena){c, 16, cap};
+    }
+    arena.used += size;
+    return arena.chunk + arena.used - size;
+}
+
+static char *arena_strndup(char *p, int len) {
+    return memcpy(arena_alloc(len + 1), p, len);
+}
+
+static void arena_free() {
+    for (char *c = arena.chunk, *prev; c; c = prev) {
+        prev = *(char **)c;
+        free(c);
+    }
+    arena = (struct Arena){0};
+}
+
 static Token *token_new(Kind id, char *ps, char *p) {
-    Token *t = calloc(sizeof(Token), 1);
+    Token *t = arena_alloc(sizeof(Token));
+    stats.tokens++;
     t->id = id;
     t->pos = ps;
     t->len = p - ps;
@@ -209,7 +945,8 @@ static Token *token_stitch(Token *t, Token *prev) {
 }
 
 static Token *token_dup(Token *src) {
-    Token *dest = malloc(sizeof(Token));
+    Token *dest = arena_alloc(sizeof(Token));
+    stats.tokens++;
     return memcpy(dest, src, sizeof(Token));
 }
 
@@ -217,18 +954,90 @@ static Token *token_instant(Kind id, char *s) {
     return token_new(id, s, s + strlen(s));
 }
 
-static void token_concat(Token *dest, Token *delim) {
-    dest->pos = strndup(dest->pos, dest->len);
-    for (Token *t = dest->next; t != delim; t = t->next) {
-        dest->pos = realloc(dest->pos, dest->len += t->len);
-        strncat(dest->pos, t->pos, t->len);
+static char *pp_number(char *p) {
+    // end of the pp-number at p, p if there is none: a digit or . digit,
+    // then digits, letters, _, . and e+ e- E+ E- p+ p- P+ P-
+    if (!isdigit(*p) && !(*p == '.' && isdigit(p[1]))) {
+        return p;
+    }
+    for (p++;; p++) {
+        if (*p && strchr("eEpP", *p) && (p[1] == '+' || p[1] == '-')) {
+            p++;
+        } else if (!isalnum(*p) && *p != '_' && *p != '.') {
+            return p;
+        }
+    }
+}
+
+static Kind token_classify(char *p, int len) {
+    // kind of p, terminated by '\0', if it is spelled as one token, TK_EOF
+    // if not
+    int n = 1;
+    if (isalpha(*p) || *p == '_') {
+        while (n < len && (isalnum(p[n]) || p[n] == '_')) {
+            n++;
+        }
+        return n < len ? TK_EOF : is_keyword(p, len) ? TK_RESERVED : TK_IDENT;
+    } else if (pp_number(p) != p) {
+        return pp_number(p) - p < len ? TK_EOF : TK_NUM;
+    } else if (len == 1 && !strchr("\"' \t\n", *p)) {
+        return TK_RESERVED;
+    }
+    return (len == 2 || len == 3) && is_keyword(p, len) ? TK_RESERVED : TK_EOF;
+}
+
+static int token_paste(Token *dest, Token *src) {
+    // dest ## src, src is removed when they make one token
+    if (!src->len || !dest->len) {
+        Token *t = src->len ? src : dest;
+        dest->id = t->id;
+        dest->pos = t->pos;
+        dest->len = t->len;
+        dest->next = src->next;
+        return 1;
+    }
+    char *p = arena_alloc(dest->len + src->len + 1);
+    memcpy(p, dest->pos, dest->len);
+    memcpy(p + dest->len, src->pos, src->len);
+    int len = dest->len + src->len;
+    Kind id = dest->id == TK_LITERAL || dest->id == TK_CH ||
+                      src->id == TK_LITERAL || src->id == TK_CH
+                  ? TK_EOF
+                  : token_classify(p, len);
+    exit_if(2 * (id == TK_EOF), dest,
+            "pasting \"%.*s\" and \"%.*s\" does not give a valid "
+            "preprocessing token",
+            dest->len, dest->pos, src->len, src->pos);
+    if (id == TK_EOF) {
+        return 0;
+    }
+    dest->id = id;
+    dest->pos = p;
+    dest->len = len;
+    dest->next = src->next;
+    return 1;
+}
+
+static int token_spell_str(Token *t, char *p) {
+    // writes t as in a string literal if p, returns the length
+    char *q = t->id == TK_LITERAL ? "\"" : t->id == TK_CH ? "'" : "";
+    int n = 0;
+    for (int i = -1; i <= t->len; i++) {
+        char c = i < 0 || i == t->len ? *q : t->pos[i];
+        if (!c) {
+            continue;
+        }
+        if (c == '"' || (c == '\\' && *q)) {
+            n += p ? sprintf(p + n, "\\") : 1;
+        }
+        n += p ? sprintf(p + n, "%c", c) : 1;
     }
-    dest->next = delim;
+    return n;
 }
 
 static Token *token_quoted(char *ps, char delim) {
     for (int flg = 0; *pos && (*pos != delim || flg); pos++) {
-        flg = *pos == '\\' ? 1 : 0;
+        flg = *pos == '\\' && !flg;
     }
     Token *t = token_new(delim == '\'' ? TK_CH : TK_LITERAL, ps, pos++);
     exit_if(!*(pos - 1), t, "No closing quote");
@@ -259,10 +1068,9 @@ static Token *token_spaces() {
     return ps == pos ? NULL : token_new(TK_SPACES, ps, pos);
 }
 
-static Token *token_next() {
+static Token *token_lex() {
     Token *t = NULL;
     Token *leadings = NULL;
-    static Kind preid = TK_NEWLINE;
 
     while (*pos) {
         char *ps = pos;
@@ -281,11 +1089,8 @@ static Token *token_next() {
             t = token_quoted(++pos, '"');
         } else if (*pos == '\'') {
             t = token_quoted(++pos, '\'');
-        } else if (isdigit(*pos)) {
-            while (isdigit(*pos)) {
-                pos++;
-            }
-            pos = (*pos == 'L' || *pos == 'F') ? pos + 1 : pos;
+        } else if (pp_number(pos) != pos) {
+            pos = pp_number(pos);
             t = token_new(TK_NUM, ps, pos);
         } else if (isalpha(*pos) || *pos == '_') {
             while (isalnum(*pos) || *pos == '_') {
@@ -315,6 +1120,70 @@ static Token *token_next() {
     return t;
 }
 
+static int src_tok(Src *s, int hint, int off) {
+    // index of the token in s->toks lexed from off, -1 if not recorded
+    if (hint < s->ntoks && s->spans[2 * hint] == off) {
+        return hint;
+    }
+    int lo = 0, hi = s->ntoks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->spans[2 * mid] < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < s->ntoks && s->spans[2 * lo] == off ? lo : -1;
+}
+
+static Token *token_next() {
+    if (perf.on && perf.phase != PH_LEX) {
+        int phase = perf_switch(PH_LEX);
+        Token *t = token_next();
+        perf_switch(phase);
+        return t;
+    }
+    Src *s = env->src;
+    int k = env->replay ? src_tok(s, env->ntok, pos - s->input) : -1;
+    if (k >= 0) {
+        Token *t = token_dup(s->toks + k);
+        env->ntok = k + 1;
+        pos = s->input + s->spans[2 * k + 1];
+        stats.tok_replays++;
+        env->nls += t->id == TK_NEWLINE;
+        t->env = env;
+        preid = t->id; // for a file lexed after this one
+        return t;
+    }
+    char *ps = pos;
+    Token *t = token_lex();
+    env->nls += t->id == TK_NEWLINE;
+    // lines skipped by stmt() and bodies lexed by macro_prep() are not
+    // recorded, so toks stay in order of input
+    if (env->record &&
+        (!s->ntoks || ps - s->input >= s->spans[2 * s->ntoks - 1])) {
+        if (s->ntoks % 1024 == 0) {
+            s->toks = realloc(s->toks, sizeof(Token) * (s->ntoks + 1024));
+            s->spans = realloc(s->spans, sizeof(int) * (s->ntoks + 1024) * 2);
+        }
+        Token *r = s->toks + s->ntoks;
+        *r = *t; // the arena of this run goes, its leadings stay
+        r->leadings = !t->leadings ? NULL
+                      : memcpy(malloc(sizeof(Token)), t->leadings,
+                               sizeof(Token));
+        s->spans[2 * s->ntoks] = ps - s->input;
+        s->spans[2 * s->ntoks + 1] = pos - s->input;
+        s->ntoks++;
+        if (t->id == TK_EOF) {
+            // -fparallel-includes workers may replay toks from now on
+            __atomic_store_n(&s->lexed, 1, __ATOMIC_RELEASE);
+            env->record = 0;
+        }
+    }
+    return t;
+}
+
 static int token_cmp(Token *t, char *s) {
     return t && (t->id == TK_IDENT || t->id == TK_RESERVED) &&
            scmp(t->pos, t->len, s);
@@ -397,13 +1266,73 @@ static Token *token_next_arg_delim(Token *t) {
     return t;
 }
 
-static void macro_add(char *key, Token *params, Token *to) {
-    Macro *m = calloc(sizeof(Macro), 1);
+static void bloom_add(char *key, int len, int n) {
+    unsigned long h = hash_bytes(HASH_INIT, key, len);
+    bloom[h % BLOOM_SIZE] += n;
+    bloom[(h >> 32) % BLOOM_SIZE] += n;
+}
+
+static int bloom_has(char *key, int len) {
+    // 0 if no macro is named key
+    unsigned long h = hash_bytes(HASH_INIT, key, len);
+    return bloom[h % BLOOM_SIZE] && bloom[(h >> 32) % BLOOM_SIZE];
+}
+
+static void bloom_rebuild() {
+    memset(bloom, 0, sizeof(bloom));
+    for (Macro *m = macro; m; m = m->next) {
+        bloom_add(m->key, strlen(m->key), !m->undef);
+    }
+    bloom_add("__LINE__", 8, 1);
+    bloom_add("__FILE__", 8, 1);
+}
+
+static Macro **macro_slot(char *p, int len) {
+    // the entry named p, the only one of the name unless -fincremental
+    // takes checkpoints: then the newest one hides older ones
+    Macro **m = &macro;
+    while (*m && !scmp(p, len, (*m)->key)) {
+        m = &(*m)->next;
+    }
+    return m;
+}
+
+static Macro *macro_new(char *key) {
+    Macro *m = arena_alloc(sizeof(Macro));
+    stats.defines++;
+    macro_gen++;
+    inc_own(key, strlen(key));
+    Macro **o = ckpts.on || !bloom_has(key, strlen(key))
+                    ? NULL
+                    : macro_slot(key, strlen(key));
+    if (o && *o) {
+        // a redefinition replaces the entry
+        bloom_add(key, strlen(key), -!(*o)->undef);
+        *o = (*o)->next;
+    }
+    bloom_add(key, strlen(key), 1);
     m->key = key;
-    m->to = to ? token_norm_args(to) : token_instant(TK_SPACES, "");
     m->next = macro;
     macro = m;
+    return m;
+}
+
+static int macro_param(Macro *m, Token *t) {
+    // t names a param of m, __VA_ARGS__ the '...' one
+    for (Token *pm = m->params; t && pm; pm = pm->next) {
+        if (token_cmp(t, "__VA_ARGS__") ? token_cmp(pm, "...")
+                                        : t->len == pm->len &&
+                                              !strncmp(t->pos, pm->pos,
+                                                       pm->len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
+static void macro_body(Macro *m, Token *params, Token *to) {
+    m->to = to ? token_norm_args(to) : token_instant(TK_SPACES, "");
+    m->is_func = params != NULL;
     if (params) {
         Token **t = &params->next;
         // rm ','/')' from token list. note each param has only one token.
@@ -413,66 +1342,153 @@ static void macro_add(char *key, Token *params, Token *to) {
         }
         *t = NULL; // use last ')' token as null termination
         m->params = params->next;
+        // the checks of expand_func(), at the definition as well
+        for (Token *t = m->to, *prev = NULL; t; prev = t, t = t->next) {
+            if (token_cmp(t, "#")) {
+                exit_if(!t->next, t, "Bad use of '#'");
+                exit_if(!macro_param(m, t->next), t->next,
+                        "No following parameter to '#'");
+            } else if (token_cmp(t, "##")) {
+                exit_if(!prev || !t->next, t, "Bad use of '##'");
+            }
+        }
+    }
+}
+
+static void macro_add(char *key, Token *params, Token *to) {
+    macro_body(macro_new(key), params, to);
+}
+
+static Macro *macro_prep(Macro *m) {
+    // lex the body kept by drc_define() as if it followed the name
+    if (m->snap) {
+        snap_prep(m);
+    }
+    if (!m->body) {
+        return m;
     }
+    char *pos0 = pos;
+    Token *cur0 = cur;
+    Env *env0 = env;
+    Kind preid0 = preid;
+    pos = m->body;
+    env = m->env;
+    preid = TK_IDENT;
+    cur = token_lex();
+    Token *params = m->is_func ? consume_func_args() : NULL;
+    macro_body(m, params, consume_to_lnend());
+    m->body = NULL;
+    pos = pos0;
+    cur = cur0;
+    env = env0;
+    preid = preid0;
+    return m;
 }
 
 static Macro *macro_get(Token *t0, Token *t1) {
-    for (Macro *m = macro; m; m = m->next) {
-        if (scmp(t0->pos, t0->len, m->key) &&
-            ((m->params && token_cmp(t1, "(")) ||
-             (!m->params && !token_cmp(t1, "(")))) {
-            return m;
+    if (t0->id == TK_CH || t0->id == TK_LITERAL) {
+        return NULL; // spelled without quotes, but never a macro
+    }
+    stats.lookups++;
+    if (isalpha(*t0->pos) || *t0->pos == '_') {
+        inc_consult(t0->pos, t0->len);
+    }
+    Macro *m = bloom_has(t0->pos, t0->len) ? macro : NULL;
+    for (; m; m = m->next) {
+        stats.lookup_walk++;
+        if (!scmp(t0->pos, t0->len, m->key)) {
+            continue;
+        } else if (m->undef) {
+            return NULL;
         }
+        return (m->is_func && token_cmp(t1, "(")) ||
+                       (!m->is_func && !token_cmp(t1, "("))
+                   ? m
+                   : NULL;
     }
     return NULL;
 }
 
 static void macro_rm(Token *t) {
-    Macro **m = &macro;
-    while (*m && !scmp(t->pos, t->len, (*m)->key)) {
-        m = &(*m)->next;
+    // while -fincremental takes checkpoints, hides the definition by a
+    // tombstone, so the lists they keep stay as they were
+    stats.undefs++;
+    macro_gen++;
+    inc_own(t->pos, t->len);
+    Macro **m = macro_slot(t->pos, t->len);
+    if (*m && !(*m)->undef && !ckpts.on) {
+        bloom_add((*m)->key, strlen((*m)->key), -1);
+        *m = (*m)->next;
+    } else if (*m && !(*m)->undef) {
+        bloom_add((*m)->key, strlen((*m)->key), -1);
+        Macro *u = arena_alloc(sizeof(Macro));
+        u->key = (*m)->key;
+        u->undef = 1;
+        u->next = macro;
+        macro = u;
     }
-    *m = *m ? (*m)->next : *m;
 }
 
-static void usedmacro_merge(UsedMacro **dest, UsedMacro *add) {
-    for (UsedMacro *ua = add; ua;) {
-        UsedMacro **ud = dest;
-        while (*ud && (*ud)->macro != ua->macro) {
-            ud = &(*ud)->next;
-        }
-        if (*ud) {
-            ua = ua->next;
-            continue;
-        }
-        *ud = ua;
-        ua = ua->next;
-        (*ud)->next = NULL;
+static int usedmacro_has(UsedMacro *u, Macro *m) {
+    while (u && u->macro != m) {
+        u = u->next;
     }
+    return u != NULL;
 }
 
-static Token *expand_recursive_list(Token **taddr) {
-    Token head = {0};
-    for (Token *prev = &head; *taddr; *taddr = (*taddr)->next) {
-        token_stitch(expand_recursive(taddr), prev);
-        prev = *taddr;
-        if (!(*taddr)->next) {
-            break;
+static void usedmacro_merge(UsedMacro **dest, UsedMacro *add) {
+    // lists are shared by tokens and memos, so nodes are never modified.
+    // share add when one list is a tail of the other, else copy the nodes
+    // of dest missing in add in front of it
+    UsedMacro *u = *dest;
+    for (; u && u != add; u = u->next) {
+    }
+    if (u || !add) {
+        return;
+    }
+    for (u = add; u && u != *dest; u = u->next) {
+    }
+    UsedMacro head = {0}, *prev = &head;
+    for (UsedMacro *ud = u ? NULL : *dest; ud; ud = ud->next) {
+        if (!usedmacro_has(add, ud->macro)) {
+            prev = prev->next = arena_alloc(sizeof(UsedMacro));
+            stats.used_nodes++;
+            prev->macro = ud->macro;
         }
     }
-    return head.next;
+    prev->next = add;
+    *dest = head.next;
 }
 
 static Token *token_stringify(Token *dest, Token *ts, Token *delim) {
-    token_concat(ts, delim);
-    dest->pos = ts->pos;
-    dest->len = ts->len;
+    // one space between tokens where there was white space
+    int len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        char *p = pass ? arena_alloc(len + 1) : NULL;
+        len = 0;
+        int ws = 0;
+        for (Token *t = ts; t != delim; t = t->next) {
+            if (t->id == TK_NEWLINE || t->id == TK_SPACES) {
+                ws = 1;
+                continue;
+            }
+            if (len && (ws || t->leadings)) {
+                len += p ? sprintf(p + len, " ") : 1;
+            }
+            len += token_spell_str(t, p ? p + len : NULL);
+            ws = 0;
+        }
+        dest->pos = p;
+    }
+    dest->pos = dest->pos ? dest->pos : "";
+    dest->len = len;
     dest->leadings = token_instant(TK_SPACES, " ");
     dest->id = TK_LITERAL;
     return dest;
 }
 
-static Token **token_replace_arg(Token **taddr, Token *start, Token *delim) {
+static Token **token_replace_arg(Token **taddr, Token *start, Token *delim,
+                                 Macro *m) {
 
     Token *next = (*taddr)->next;
     UsedMacro *used = (*taddr)->used;
@@ -480,6 +1496,7 @@ static Token **token_replace_arg(Token **taddr, Token *start, Token *delim) {
 
     for (Token *t = start; t != delim; t = t->next, taddr = &(*taddr)->next) {
         *taddr = token_dup(t); // dup for case of f(x) => x x
+        m->ntoks++;
         usedmacro_merge(&(*taddr)->used, used);
         if ((*taddr)->next == delim) {
             break;
@@ -514,38 +1531,40 @@ static Token *token_matched_arg(Token *ag, Macro *m, Token **saddr) {
 static Token *expand_def(Macro *m, UsedMacro *used) {
     Token head = {0};
     Token *t = m->to;
+    // one hideset shared by every token of the expansion
+    UsedMacro *u = arena_alloc(sizeof(UsedMacro));
+    stats.used_nodes++;
+    u->macro = m;
+    u->next = used;
     for (Token *prev = &head; t; prev = t, t = t->next) {
         t = token_dup(t);
-        t->used = calloc(sizeof(UsedMacro), 1);
-        t->used->macro = m;
-        t->used->next = used;
+        t->used = u;
         t = token_stitch(t, prev);
+        m->ntoks++;
     }
     return head.next;
 }
 
-static Token *expand_func(Token **saddr, Macro *m) {
-    // expand arguments before other macro expansion
-    Token *t = (*saddr)->next->next;
-    Token *te = token_skip_after_func(*saddr);
-    for (Token *prev = (*saddr)->next; t != te; t = t->next) {
-        token_stitch(expand_recursive(&t), prev);
-        prev = t;
-    }
-
+static Token *expand_func(Token *inv, Macro *m) {
     // expand macro and matched params with actual args
-    Token *head = expand_def(m, (*saddr)->used);
-    head->leadings = (*saddr)->leadings;
+    Token *head = expand_def(m, inv->used);
+    head->leadings = inv->leadings;
     Token **taddr = &head;
 
     for (Token *prev = NULL; *taddr; prev = *taddr, taddr = &(*taddr)->next) {
-        Token *tdelim = *saddr;
+        Token *tdelim = inv;
         Token *ts = NULL;
         if (token_cmp(*taddr, "#")) {
             exit_if(!(*taddr)->next, *taddr, "Bad use of '#'");
 
             *taddr = (*taddr)->next; // remove '#'
-            if ((ts = token_matched_arg(*taddr, m, &tdelim))) {
+            Token *tp = token_cmp(*taddr, "__VA_ARGS__")
+                            ? token_instant(TK_RESERVED, "...")
+                            : *taddr;
+            if ((ts = token_matched_arg(tp, m, &tdelim))) {
+                while (tp != *taddr && token_cmp(tdelim, ",")) {
+                    tdelim = token_next_arg_delim(tdelim->next);
+                }
                 *taddr = token_stringify(*taddr, ts, tdelim);
             }
 
@@ -556,10 +1575,14 @@ static Token *expand_func(Token **saddr, Macro *m) {
             prev->next = *taddr = (*taddr)->next; // remove '##'
             (*taddr)->leadings = NULL;
             if ((ts = token_matched_arg(*taddr, m, &tdelim))) {
-                taddr = token_replace_arg(taddr, ts, tdelim);
+                taddr = token_replace_arg(taddr, ts, tdelim, m);
+            }
+            // paste the first token of the operand, go on after its last
+            Token *first = prev->next;
+            Token *last = *taddr;
+            if (token_paste(prev, first) && last == first) {
+                taddr = &prev;
             }
-            token_concat(prev, (*taddr)->next);
-            taddr = &prev;
 
         } else if (token_cmp(*taddr, "__VA_ARGS__")) {
 
@@ -567,62 +1590,216 @@ static Token *expand_func(Token **saddr, Macro *m) {
             ts = token_matched_arg(tp, m, &tdelim);
             exit_if(!ts, *taddr, "No matched func param(...) for __VA_ARGS__");
 
-            while (!token_cmp(tdelim, ")")) {
-                tdelim = tdelim->next;
+            while (token_cmp(tdelim, ",")) {
+                tdelim = token_next_arg_delim(tdelim->next);
             }
-            taddr = token_replace_arg(taddr, ts, tdelim);
+            taddr = token_replace_arg(taddr, ts, tdelim, m);
 
         } else if ((ts = token_matched_arg(*taddr, m, &tdelim))) {
-            taddr = token_replace_arg(taddr, ts, tdelim);
+            taddr = token_replace_arg(taddr, ts, tdelim, m);
         }
     }
 
-    // stitch tokens and recur macro expansion
-    Token *tt = head;
-    head = expand_recursive_list(&tt);
-    tt->next = token_skip_after_func(*saddr);
-    *saddr = tt;
     return head;
 }
 
-static Token *expand_obj(Token **saddr, Macro *m) {
-    Token *t = expand_def(m, (*saddr)->used);
-    Token *head = expand_recursive_list(&t);
-    t->next = (*saddr)->next;
-    *saddr = t;
-    return head;
+static void prof_begin(Frame *f) {
+    Macro *m = f->m;
+    if (!m->calls++) {
+        profs = realloc(profs, sizeof(Macro *) * (nprofs + 1));
+        profs[nprofs++] = m;
+    }
+    m->depth++;
+    m->max_depth = f->depth > m->max_depth ? f->depth : m->max_depth;
+    f->ts = trace_now();
 }
 
-static Token *expand_recursive(Token **saddr) {
-    if (token_cmp(*saddr, "__LINE__") || token_cmp(*saddr, "__FILE__")) {
-        (*saddr)->macro_org = macro_org;
-        return *saddr;
-    }
+static void prof_end(Frame *f) {
+    // inclusive time, counted once for recursive use via arguments
+    f->m->time += --f->m->depth ? 0 : trace_now() - f->ts;
+}
 
-    Macro *m = NULL;
-    if (!(m = macro_get(*saddr, (*saddr)->next))) {
-        return *saddr;
-    }
+static int prof_cmp(const void *a, const void *b) {
+    double d = (*(Macro **)b)->time - (*(Macro **)a)->time;
+    return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
 
-    for (UsedMacro *used = (*saddr)->used; used; used = used->next) {
-        if (token_cmp(*saddr, used->macro->key)) {
-            return *saddr;
+static void prof_print() {
+    qsort(profs, nprofs, sizeof(Macro *), prof_cmp);
+    dprintf(errfd, "%-24s %8s %8s %5s %10s  %s\n", "macro", "calls", "tokens",
+            "depth", "time(us)", "defined at");
+    for (int i = 0; i < nprofs && i < opts.macro_profile; i++) {
+        Macro *m = profs[i];
+        dprintf(errfd, "%-24s %8ld %8ld %5d %10.1f  ", m->key, m->calls,
+                m->ntoks, m->max_depth, m->time);
+        if (m->def) {
+            dprintf(errfd, "%s:%d\n", m->def->env->path, linenum(m->def));
+        } else {
+            dprintf(errfd, "<built-in>\n");
         }
     }
+    for (int i = 0; i < nprofs; i++) {
+        profs[i]->calls = profs[i]->ntoks = profs[i]->max_depth = 0;
+        profs[i]->time = 0;
+    }
+    nprofs = 0;
+}
 
-    if (m->params && ((*saddr)->next && token_cmp((*saddr)->next, "("))) {
-        return expand_func(saddr, m);
+static Token *expand_memo(Token *t, Token *end, int line) {
+    // copy of t..end, __LINE__ takes the line of the current expansion
+    Token head = {0};
+    for (Token *prev = &head;; t = t->next) {
+        prev = token_stitch(token_dup(t), prev);
+        if (line && token_cmp(prev, "__LINE__")) {
+            prev->macro_org = macro_org;
+        }
+        if (t == end || !t->next) {
+            prev->next = NULL;
+            return head.next;
+        }
     }
-    return expand_obj(saddr, m);
+}
+
+static int expand_push(Token *inv) {
+    if (token_cmp(inv, "__LINE__") || token_cmp(inv, "__FILE__")) {
+        inv->macro_org = macro_org;
+        return 0;
+    }
+
+    Macro *m = NULL;
+    if (!(m = macro_get(inv, inv->next))) {
+        return 0;
+    }
+
+    for (UsedMacro *used = inv->used; used; used = used->next) {
+        if (token_cmp(inv, used->macro->key)) {
+            return 0;
+        }
+    }
+
+    macro_prep(m);
+    Frame *f = frees ? frees : malloc(sizeof(Frame));
+    frees = f == frees ? frees->next : frees;
+    *f = (Frame){.m = m, .inv = inv, .depth = frames ? frames->depth + 1 : 1,
+                 .next = frames};
+    frames = f;
+    if (m->is_func && (inv->next && token_cmp(inv->next, "("))) {
+        // expand arguments before other macro expansion
+        stats.expand_func++;
+        f->is_func = f->in_args = 1;
+        f->prev = inv->next;
+        f->t = inv->next->next;
+        f->end = token_skip_after_func(inv);
+    } else if (m->memo && m->memo_gen == macro_gen &&
+               m->memo_used == inv->used) {
+        // same definitions and hideset give the same expansion
+        stats.expand_obj++;
+        stats.memo_hits++;
+        f->is_memo = 1;
+        f->head.next = expand_memo(m->memo, NULL, m->memo_line);
+        for (f->prev = f->head.next; f->prev->next;) {
+            f->prev = f->prev->next;
+        }
+    } else {
+        stats.expand_obj++;
+        f->prev = &f->head;
+        f->t = expand_def(m, inv->used);
+    }
+    if (opts.macro_profile) {
+        prof_begin(f);
+    }
+    return 1;
+}
+
+static void memo_store(Macro *m, Token *inv, Token *head, Token *last) {
+    // keep expansions used twice under the same definitions
+    if (m->miss_gen != macro_gen) {
+        m->miss_gen = macro_gen;
+        return;
+    }
+    m->memo = expand_memo(head, last, 0);
+    m->memo_used = inv->used;
+    m->memo_gen = macro_gen;
+    m->memo_line = 0;
+    for (Token *t = m->memo; t; t = t->next) {
+        m->memo_line |= token_cmp(t, "__LINE__");
+    }
+}
+
+static Token *expand_recursive(Token **saddr) {
+    // expansions in progress are kept on frames instead of the C stack.
+    // the expanded tokens replace *saddr, which is set to the last of them.
+    Frame *base = frames;
+    if (!expand_push(*saddr)) {
+        return *saddr;
+    }
+    for (;;) {
+        Frame *f = frames;
+        if (f->in_args ? f->t != f->end : f->t != NULL) {
+            if (!expand_push(f->t)) {
+                f->prev = token_stitch(f->t, f->prev);
+                f->t = f->t->next;
+            }
+            continue;
+        }
+        if (f->in_args) {
+            f->in_args = 0;
+            f->prev = &f->head;
+            f->t = expand_func(f->inv, f->m);
+            continue;
+        }
+
+        // stitch the rescanned replacement in place of the invocation
+        Token *head = f->head.next;
+        Token *last = f->prev;
+        if (!f->is_func && !f->is_memo) {
+            memo_store(f->m, f->inv, head, last);
+        }
+        last->next = f->is_func ? f->end : f->inv->next;
+        if (opts.macro_profile) {
+            prof_end(f);
+        }
+        frames = f->next;
+        f->next = frees;
+        frees = f;
+        if (frames == base) {
+            *saddr = last;
+            return head;
+        }
+        token_stitch(head, frames->prev);
+        frames->prev = last;
+        frames->t = last->next;
+    }
+}
+
+static Token *trace_expand(Token **saddr) {
+    double ts = trace_now();
+    Token *org = *saddr;
+    trace.expanding = 1;
+    Token *t = expand_macro(saddr);
+    trace.expanding = 0;
+    if (trace_now() - ts >= opts.time_trace_granularity) {
+        trace_event('X', "expand", ts, org, org->pos, org->len);
+    }
+    return t;
 }
 
 static Token *expand_macro(Token **saddr) {
+    if (trace.on && !trace.expanding) {
+        return trace_expand(saddr);
+    }
+    if (perf.on && perf.phase != PH_EXPAND) {
+        int phase = perf_switch(PH_EXPAND);
+        Token *t = expand_macro(saddr);
+        perf_switch(phase);
+        return t;
+    }
     Macro *m = NULL;
     if (!(m = macro_get(*saddr, cur))) {
         return *saddr;
     }
 
-    if (m->params && (cur && token_cmp(cur, "("))) {
+    if (m->is_func && (cur && token_cmp(cur, "("))) {
         token_stitch(consume_func_args(), *saddr);
     }
 
@@ -632,17 +1809,57 @@ static Token *expand_macro(Token **saddr) {
     return t;
 }
 
+static int inc_access(char *path) {
+    // access() results are kept until entries of the dir are changed
+    char *key = *path == '/' ? path : mk_path(NULL, cwd, path);
+    pthread_mutex_lock(&shared);
+    Probe *p = map_get(&probes, key, strlen(key));
+    if (!p) {
+        char *dir = dirname(strdup(key));
+        p = calloc(sizeof(Probe), 1);
+        p->gen = -1;
+        if (!(p->dir = map_get(&probedirs, dir, strlen(dir)))) {
+            p->dir = calloc(sizeof(ProbeDir), 1);
+            p->dir->path = dir;
+            map_put(&probedirs, dir, strlen(dir), p->dir);
+        }
+        map_put(&probes, key, strlen(key), p);
+    }
+    ProbeDir *d = p->dir;
+    stats.probes++;
+    if (d->run != run) {
+        struct stat st = {0};
+        stat(d->path, &st);
+        if (st.st_mtim.tv_sec != d->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != d->mtime.tv_nsec) {
+            d->mtime = st.st_mtim;
+            d->gen++;
+        }
+        d->run = run;
+    }
+    if (p->gen != d->gen) {
+        p->ok = access(path, R_OK) == 0;
+        p->gen = d->gen;
+        stats.accesses++;
+    }
+    if (!p->ok && opts.cache_dir) {
+        map_put(&missing, key, strlen(key), p);
+    }
+    pthread_mutex_unlock(&shared);
+    return p->ok;
+}
+
 static char *inc_path_find(char *fname, int *skips, int is_local) {
     char *path = NULL;
     if (is_local && *skips == 0) { // check current dir first
         path = mk_path(path, dirname(strdup(env->path)), fname);
-        if (access(path, R_OK) == 0) {
+        if (inc_access(path)) {
             return path;
         }
     }
     for (int i = 0; i < incdir.len; i++) {
         path = mk_path(path, incdir.dir[i], fname);
-        if (i >= (*skips) && access(path, R_OK) == 0) {
+        if (i >= (*skips) && inc_access(path)) {
             *skips = i;
             return path;
         }
@@ -650,6 +1867,377 @@ static char *inc_path_find(char *fname, int *skips, int is_local) {
     return NULL;
 }
 
+static int inc_is_sys(char *path) {
+    for (int i = incdir.nuser; i < incdir.len; i++) {
+        if (strncmp(path, incdir.dir[i], strlen(incdir.dir[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct _IncRec {
+    IncMemo *memo;
+    Map seen;    // keys in deps or changed: 1 looked up, 2 changed
+    IncKey *own; // changed keys, resolved by inc_end()
+    Token *ocur; // output before the include
+    File *ftail; // last file before the include
+};
+
+struct Incs {
+    int record; // record includes for later runs, see inc_find()
+    int active; // includes being recorded
+    int *dead;  // for memos recorded in this run, see IncMemo
+    int worker; // running a Job
+    int nojobs; // rerun after a Job failed
+    Job *jobs;  // started in this run
+    int njobs;
+    Map memos;  // path => IncMemo
+} __thread incs = {0};
+
+static Macro *macro_find(char *key) {
+    Macro *m = macro;
+    while (m && strcmp(m->key, key) != 0) {
+        m = m->next;
+    }
+    return m && !m->undef ? m : NULL;
+}
+
+static unsigned long macro_hash(Macro *m) {
+    // identifies a definition over runs, never 0
+    if (!m->hash) {
+        macro_prep(m);
+        unsigned long h = hash_bytes(HASH_INIT, m->is_func ? "(" : " ", 1);
+        for (Token *t = m->params; t; t = t->next) {
+            h = hash_bytes(hash_bytes(h, t->pos, t->len), ",", 1);
+        }
+        for (Token *t = m->to; t; t = t->next) {
+            char k[2] = {t->id, t->leadings != NULL};
+            h = hash_bytes(hash_bytes(h, k, 2), t->pos, t->len);
+        }
+        m->hash = h | 1;
+    }
+    return m->hash;
+}
+
+static char *inc_file_key(char *path) {
+    char *key = calloc(sizeof(char), strlen(path) + 2);
+    return strcat(strcpy(key, "\""), path);
+}
+
+static unsigned long inc_hash(char *key) {
+    // state of the key of IncKey in this run, 0 if undefined
+    if (*key == '"') {
+        File *f = files;
+        while (f && strcmp(f->path, key + 1) != 0) {
+            f = f->next;
+        }
+        return f ? f->once : 0;
+    }
+    Macro *m = macro_find(key);
+    return m ? macro_hash(m) : 0;
+}
+
+static void inc_consult(char *key, int len) {
+    // the includes being recorded depend on key unless they changed it
+    for (Env *e = env; incs.active && e; e = e->next) {
+        if (!e->rec) {
+            continue;
+        } else if (map_get(&e->rec->seen, key, len)) {
+            return; // so do outer ones
+        }
+        map_put(&e->rec->seen, key, len, (void *)1);
+        IncKey *k = calloc(sizeof(IncKey), 1);
+        k->key = strndup(key, len);
+        k->hash = inc_hash(k->key);
+        k->next = e->rec->memo->deps;
+        e->rec->memo->deps = k;
+    }
+}
+
+static void inc_own(char *key, int len) {
+    for (Env *e = env; incs.active && e; e = e->next) {
+        if (!e->rec) {
+            continue;
+        } else if ((long)map_get(&e->rec->seen, key, len) == 2) {
+            return;
+        }
+        map_put(&e->rec->seen, key, len, (void *)2);
+        IncKey *k = calloc(sizeof(IncKey), 1);
+        k->key = strndup(key, len);
+        k->next = e->rec->own;
+        e->rec->own = k;
+    }
+}
+
+static void inc_src(IncMemo *im, Src *s) {
+    if (im->nsrcs % 16 == 0) {
+        im->srcs = realloc(im->srcs, sizeof(Src *) * (im->nsrcs + 16));
+    }
+    im->srcs[im->nsrcs++] = s;
+    __atomic_store_n(&s->memo, 1, __ATOMIC_RELEASE);
+}
+
+static int inc_fresh(IncMemo *im) {
+    struct stat st;
+    for (int i = 0; i < im->nsrcs; i++) {
+        if (stat(im->srcs[i]->path, &st) != 0 ||
+            src_get(im->srcs[i]->path) != im->srcs[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void inc_begin(int skips) {
+    IncRec *r = env->rec = calloc(sizeof(IncRec), 1);
+    r->memo = calloc(sizeof(IncMemo), 1);
+    r->memo->skips = skips;
+    r->memo->is_sys = env->is_sys;
+    r->memo->dead = incs.dead;
+    inc_src(r->memo, env->src);
+    r->ocur = ocur;
+    for (r->ftail = files; r->ftail->next; r->ftail = r->ftail->next) {
+    }
+    incs.active++;
+    macro_gen++; // memos of expansions have not been looked up by r
+}
+
+static void inc_end(Env *e) {
+    IncRec *r = e->rec;
+    IncMemo *im = r->memo;
+    IncKey **tail = &im->defs;
+    for (File *f = r->ftail->next; f; f = f->next, tail = &(*tail)->next) {
+        *tail = calloc(sizeof(IncKey), 1);
+        (*tail)->key = inc_file_key(f->path);
+        (*tail)->hash = f->once;
+        (*tail)->is_sys = f->is_sys;
+    }
+    *tail = r->own;
+    for (IncKey *k = r->own; k; k = k->next) {
+        k->hash = inc_hash(k->key);
+        k->m = *k->key == '"' ? NULL : macro_find(k->key);
+        k->is_sys = *k->key == '"' && file_add(k->key + 1, 0)->is_sys;
+    }
+    if (r->ocur != ocur) {
+        im->first = r->ocur->next;
+        im->last = ocur;
+        for (Token *t = im->first;; t = t->next) {
+            im->ntoks++;
+            if (t == im->last) {
+                break;
+            }
+        }
+        im->toks = malloc(sizeof(Token) * im->ntoks);
+        Token *t = im->first;
+        for (int i = 0; i < im->ntoks; i++, t = t->next) {
+            im->toks[i] = *t;
+        }
+    }
+    // drop memos of the path which can not be used any more
+    IncMemo **tail2 = &im->next;
+    IncMemo *o = map_get(&incs.memos, e->path, strlen(e->path));
+    for (IncMemo *next; o; o = next) {
+        next = o->next;
+        if (!*o->dead && inc_fresh(o)) {
+            *tail2 = o;
+            tail2 = &o->next;
+        }
+    }
+    *tail2 = NULL;
+    map_put(&incs.memos, e->path, strlen(e->path), im);
+    incs.active--;
+}
+
+static IncMemo *inc_find(char *path, int skips, int is_sys) {
+    // a recorded include that looked up the same macros and files
+    for (IncMemo *im = map_get(&incs.memos, path, strlen(path)); im;
+         im = im->next) {
+        if (*im->dead || (im->dead == incs.dead && incs.jobs)) {
+            continue; // may have outputs of Jobs not spliced yet
+        }
+        IncKey *k = im->deps;
+        while (k && inc_hash(k->key) == k->hash) {
+            k = k->next;
+        }
+        if (!k && im->skips == skips && im->is_sys == is_sys) {
+            return im;
+        }
+    }
+    return NULL;
+}
+
+static void inc_apply(IncMemo *im) {
+    // changes of macros and files as the include did
+    for (IncKey *k = im->deps; k; k = k->next) {
+        inc_consult(k->key, strlen(k->key));
+    }
+    for (IncKey *k = im->defs; k; k = k->next) {
+        if (*k->key == '"') {
+            File *f = file_add(k->key + 1, k->is_sys);
+            f->once |= k->hash;
+            if (k->hash) {
+                inc_own(k->key, strlen(k->key));
+            }
+            continue;
+        }
+        macro_rm(token_instant(TK_IDENT, k->key));
+        if (k->m) {
+            Macro *m = macro_new(k->key);
+            m->params = k->m->params;
+            m->to = k->m->to;
+            m->is_func = k->m->is_func;
+            m->body = k->m->body;
+            m->body_end = k->m->body_end;
+            m->snap = k->m->snap;
+            m->env = k->m->env;
+            m->def = k->m->def;
+            m->hash = k->m->hash;
+        }
+    }
+}
+
+static void inc_replay(IncMemo *im) {
+    stats.inc_replays++;
+    inc_apply(im);
+    if (opts.deps_only || !im->ntoks) {
+        return;
+    }
+    // one block for the whole output, linked in place
+    Token *ts = arena_alloc(sizeof(Token) * im->ntoks);
+    memcpy(ts, im->toks, sizeof(Token) * im->ntoks);
+    for (int i = 0; i + 1 < im->ntoks; i++) {
+        ts[i].next = ts + i + 1;
+    }
+    ts[im->ntoks - 1].next = NULL;
+    stats.tokens += im->ntoks;
+    token_stitch(ts, ocur);
+    ocur = ts + im->ntoks - 1;
+}
+
+static void *job_run(void *arg) {
+    Job *j = arg;
+    jmp_buf jb;
+    recover = &jb;
+    errfd = open("/dev/null", O_WRONLY); // this thread runs again if needed
+    if (setjmp(jb)) {
+        pthread_mutex_unlock(&shared); // fails unless held
+        close(errfd);
+        return NULL;
+    }
+    incs.worker = 1;
+    incs.dead = calloc(sizeof(int), 1);
+    env = calloc(sizeof(Env), 1);
+    macro = j->macros;
+    files = j->files;
+    bloom_rebuild();
+    Token head = {0};
+    ocur = &head;
+    env_push(j->path, j->skips, j->is_sys);
+    inc_begin(j->skips);
+    IncRec *r = env->rec;
+    stmt();
+    drc_include_end();
+    j->memo = r->memo;
+    close(errfd);
+    return NULL;
+}
+
+static int job_start(IncMemo *im, char *path, int skips, int is_sys) {
+    // the files of im changed but it looked up the same macros: a worker
+    // redoes it from copies of macros and files here and this thread goes
+    // on with the changes im made, checked by jobs_join(). 0 if no thread
+    // could be started and the caller includes the file itself
+    Job *j = calloc(sizeof(Job), 1);
+    j->path = path;
+    j->skips = skips;
+    j->is_sys = is_sys;
+    j->pred = im;
+    Macro **mt = &j->macros;
+    for (Macro *m = macro; m; m = m->next, mt = &(*mt)->next) {
+        *mt = calloc(sizeof(Macro), 1);
+        (*mt)->key = m->key;
+        (*mt)->params = m->params;
+        (*mt)->to = m->to;
+        (*mt)->is_func = m->is_func;
+        (*mt)->body = m->body;
+        (*mt)->body_end = m->body_end;
+        (*mt)->snap = m->snap;
+        (*mt)->env = m->env;
+        (*mt)->def = m->def;
+        (*mt)->hash = m->hash;
+        (*mt)->undef = m->undef;
+    }
+    File **ft = &j->files;
+    for (File *f = files; f; f = f->next, ft = &(*ft)->next) {
+        *ft = calloc(sizeof(File), 1);
+        **ft = *f;
+    }
+    *ft = NULL;
+    if (pthread_create(&j->th, NULL, job_run, j)) {
+        for (Macro *m = j->macros, *next; m; m = next) {
+            next = m->next;
+            free(m);
+        }
+        for (File *f = j->files, *next; f; f = next) {
+            next = f->next;
+            free(f);
+        }
+        free(j);
+        return 0;
+    }
+    inc_apply(im);
+    if (!opts.deps_only) {
+        j->at = ocur = token_stitch(token_instant(TK_SPACES, ""), ocur);
+    }
+    j->next = incs.jobs;
+    incs.jobs = j;
+    incs.njobs++;
+    stats.inc_jobs++;
+    return 1;
+}
+
+static int inc_covers(IncKey *a, IncKey *b) {
+    // every key of a is in b in the same state
+    Map m = {0};
+    for (; b; b = b->next) {
+        map_put(&m, b->key, strlen(b->key), b);
+    }
+    for (; a; a = a->next) {
+        IncKey *k = map_get(&m, a->key, strlen(a->key));
+        if (!k || k->hash != a->hash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int jobs_join() {
+    // splice results of workers which changed macros and files as this
+    // thread predicted
+    int ok = 1;
+    for (Job *j = incs.jobs; j; j = j->next) {
+        pthread_join(j->th, NULL);
+        IncMemo *im = j->memo;
+        if (!im || !inc_covers(im->defs, j->pred->defs) ||
+            !inc_covers(j->pred->defs, im->defs)) {
+            stats.inc_job_fails++;
+            ok = 0;
+            continue;
+        }
+        if (j->at && im->first) {
+            im->last->next = j->at->next;
+            j->at->next = im->first;
+        }
+        im->dead = incs.dead;
+        im->next = map_get(&incs.memos, j->path, strlen(j->path));
+        map_put(&incs.memos, j->path, strlen(j->path), im);
+    }
+    incs.jobs = NULL;
+    incs.njobs = 0;
+    return ok;
+}
+
 static void drc_include(Token *t, int skips) {
 
     Token *tp = NULL;
@@ -670,18 +2258,183 @@ static void drc_include(Token *t, int skips) {
     }
     exit_if(!path, tp, "Can not find include file: %.*s", tp->len, tp->pos);
 
-    env_push(path, skips);
-    stmt(0);
+    // skip opening files whose whole content is known to be skipped
+    int is_sys = env->is_sys || inc_is_sys(path);
+    File *f = file_add(path, is_sys);
+    f->guard = f->guard ? f->guard : src_get(path)->guard;
+    if (incs.active) {
+        char *key = inc_file_key(path);
+        inc_consult(key, strlen(key));
+    }
+    if (f->once ||
+        (f->guard && macro_get(token_instant(TK_IDENT, f->guard), NULL))) {
+        return;
+    }
+
+    exit_if(env->level >= opts.max_include_depth, tp,
+            "#include nested depth %d exceeds maximum of %d (use "
+            "-fmax-include-depth=DEPTH to increase the maximum)",
+            env->level + 1, opts.max_include_depth);
+    IncMemo *im = opts.warm && (opts.nconfigs || opts.parallel_includes)
+                      ? inc_find(path, skips, is_sys)
+                      : NULL;
+    if (im && inc_fresh(im)) {
+        inc_replay(im);
+        return;
+    } else if (im && !incs.worker && !incs.nojobs &&
+               incs.njobs < opts.parallel_includes &&
+               job_start(im, path, skips, is_sys)) {
+        return;
+    }
+    if (trace.on) {
+        trace.depth++;
+        trace_event('B', "include", trace_now(), tp, path, strlen(path));
+    }
+    // stmt() goes on with the included file and calls drc_include_end()
+    env_push(path, skips, is_sys);
+    if (incs.record) {
+        inc_begin(skips);
+    }
+}
+
+static void drc_include_end() {
+    Env *e = env;
     env_pop();
+    if (trace.on) {
+        trace_event('E', "include", trace_now(), NULL, NULL, 0);
+        trace.depth--;
+    }
+    if (e->guard && e->items == 1) {
+        e->src->guard = e->file->guard =
+            strndup(e->guard->pos, e->guard->len);
+    }
+    if (e->rec) {
+        inc_end(e);
+    }
+}
+
+static void drc_pragma(Token *t) {
+    if (consume("once")) {
+        if (ckpts.on && !env->file->once) {
+            Incr *ir = ckpts.ir;
+            ir->onces = realloc(ir->onces, sizeof(char *) * (ir->nonces + 1));
+            ir->onces[ir->nonces++] = env->file->path;
+            ckpts.ostate = hash_str(ckpts.ostate, env->file->path);
+        }
+        env->file->once = 1;
+        if (incs.active) {
+            char *key = inc_file_key(env->file->path);
+            inc_own(key, strlen(key));
+        }
+        consume_to_lnend();
+        return;
+    }
+    // other pragmas are passed through to the output
+    Token *ts = consume_to_lnend();
+    if (!opts.deps_only) {
+        ocur = token_stitch(token_instant(TK_RESERVED, "#"), ocur);
+        ocur = token_stitch(t, ocur);
+        for (ocur->next = ts; ocur->next; ocur = ocur->next) {
+        }
+        ocur = token_stitch(token_instant(TK_NEWLINE, "\n"), ocur);
+    }
+}
+
+static char *drc_define_end(char *p) {
+    // skip to the end of line as token_lex() would, without making tokens
+    while (*p && *p != '\n') {
+        if (scmp(p, 2, "//")) {
+            p += strcspn(p, "\n");
+        } else if (scmp(p, 2, "/*")) {
+            char *e = strstr(p + 2, "*/");
+            p = e ? e + 2 : p + strlen(p);
+        } else if (scmp(p, 2, "\\\n")) {
+            p += 2;
+        } else if (*p == '"' || *p == '\'') {
+            char delim = *p++;
+            for (int flg = 0; *p && (*p != delim || flg); p++) {
+                flg = *p == '\\' && !flg;
+            }
+            p += *p ? 1 : 0;
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+static int drc_define_lazy(char *ps, char *pe, int is_func) {
+    // the body [ps, pe) can wait for macro_prep(): it has none of the
+    // errors drc_define() reports when lexing it
+    if (!*pe) {
+        return 0; // maybe a quote without the closing one
+    } else if (!is_func) {
+        return 1;
+    } else if (memchr(ps, '#', pe - ps)) {
+        return 0; // '#' and '##' are checked by macro_body()
+    }
+    // params on this line, none of them empty
+    for (int empty = 1, n = 0; ps < pe; ps++) {
+        if (*ps == '/' || *ps == '\\') {
+            return 0; // comments and continuations are left to the lexer
+        } else if (*ps == ',' || *ps == ')') {
+            if (empty && (*ps == ',' || n)) {
+                return 0;
+            } else if (*ps == ')') {
+                return 1;
+            }
+            empty = 1;
+            n++;
+        } else if (*ps != '(' && !isspace(*ps)) {
+            empty = 0;
+        }
+    }
+    return 0;
+}
+
+static int drc_define_same(Macro *m, char *ps, char *pe) {
+    // m is defined by the text [ps, pe) after the name, an identical
+    // redefinition keeps the first one
+    char *p = !m || m->undef ? NULL
+              : m->body      ? m->body
+              : m->def       ? m->def->pos + m->def->len
+                             : NULL;
+    char *e = !p ? NULL : m->body ? m->body_end : drc_define_end(p);
+    return p && e - p == pe - ps && memcmp(p, ps, pe - ps) == 0;
 }
 
 static void drc_define() {
     Token *key = expect_id(TK_IDENT);
-    Token *params = NULL;
-    if ((token_cmp(cur, "(")) && !cur->leadings) {
-        params = consume_func_args();
+    char *ps = key->pos + key->len;
+    Macro *m = bloom_has(key->pos, key->len)
+                   ? *macro_slot(key->pos, key->len)
+                   : NULL;
+    int is_func = token_cmp(cur, "(") && !cur->leadings;
+    char *pe = cur->next || cur->id == TK_NEWLINE || cur->id == TK_EOF
+                   ? NULL
+                   : drc_define_end(pos);
+    if (pe && drc_define_lazy(ps, pe, is_func)) {
+        // keep the body unlexed until the macro is expanded
+        if (!drc_define_same(m, ps, pe)) {
+            m = macro_new(arena_strndup(key->pos, key->len));
+            m->is_func = is_func;
+            m->body = ps;
+            m->body_end = pe;
+            m->env = env;
+            m->def = key;
+        }
+        pos = pe;
+        cur = token_next();
+        consume_id(TK_NEWLINE);
+        return;
     }
-    macro_add(strndup(key->pos, key->len), params, consume_to_lnend());
+    if (drc_define_same(m, ps, drc_define_end(ps))) {
+        consume_to_lnend();
+        return;
+    }
+    Token *params = is_func ? consume_func_args() : NULL;
+    macro_add(arena_strndup(key->pos, key->len), params, consume_to_lnend());
+    macro->def = key;
 }
 
 static int primary() {
@@ -691,7 +2444,7 @@ static int primary() {
         ret = expr();
         expect(")");
     } else if ((t = consume_id(TK_NUM))) {
-        ret = atoi(strndup(t->pos, t->len));
+        ret = strtol(arena_strndup(t->pos, t->len), NULL, 0); // suffixes ignored
     } else if ((t = consume_id(TK_CH))) {
         char *p = *t->pos == '\\' ? t->pos + 1 : t->pos;
         exit_if(*(p + 1) != '\'', t, "Invalid char length");
@@ -812,166 +2565,2076 @@ static int ifcond() {
     return ret;
 }
 
-static void cntlflow(int on) {
-
-    on ? stmt(0) : stmt_off();
-
-    while (consume("elif")) {
-        on = !on && expr();
-        on ? stmt(0) : stmt_off();
+static void cond_push(int state) {
+    if (nconds % 64 == 0) {
+        conds = realloc(conds, nconds + 64);
     }
-    if (consume("else")) {
-        !on ? stmt(0) : stmt_off();
-    }
-    expect("endif");
+    conds[nconds++] = state;
+    env->depth++;
 }
 
-static void stmt_off() {
-    while (cur->id != TK_EOF) {
-        if (consume_id(TK_DIRECTIVE)) {
-            if (consume("if") || consume("ifdef") || consume("ifndef")) {
-                consume_to_lnend();
-                stmt_off();
-                while (consume("elif")) {
-                    consume_to_lnend();
-                    stmt_off();
-                }
-                if (consume("else")) {
-                    stmt_off();
-                }
-                expect("endif");
-                continue;
-            } else if (token_cmp(cur, "elif") || token_cmp(cur, "else") ||
-                       token_cmp(cur, "endif")) {
-                return;
-            }
-            continue;
+static void cond_next(Token *t) {
+    // #elif, #else and #endif switch the innermost #if of this file
+    exit_if(!env->depth, t, "no matched if-staement");
+    char *c = &conds[nconds - 1];
+    if (consume("endif")) {
+        nconds--;
+        env->depth--;
+        return;
+    }
+    env->guard = env->depth == 1 ? NULL : env->guard;
+    if (consume("elif")) {
+        if (*c == IF_DEAD) {
+            consume_to_lnend();
+            stats.skip_lines++;
+        } else {
+            *c = *c == IF_OFF ? (expr() ? IF_ON : IF_OFF) : IF_DONE;
         }
-        consume_any();
+    } else if (consume("else")) {
+        *c = *c == IF_OFF ? IF_ON : *c == IF_DEAD ? IF_DEAD : IF_DONE;
     }
-    return;
 }
 
-static void stmt(int is_top) {
-    Token *t = NULL;
-    while (cur->id != TK_EOF) {
-        if (consume_id(TK_DIRECTIVE)) {
-            if (consume("define")) {
-                drc_define();
-            } else if (consume("undef")) {
-                macro_rm(expect_id(TK_IDENT));
-            } else if (consume("warning")) {
-                exit_if(2, consume_to_lnend(), "warning message");
-            } else if (consume("error")) {
-                exit_if(1, consume_to_lnend(), "error message");
-            } else if ((t = consume("include_next"))) {
-                drc_include(t, env->skips + 1);
-            } else if ((t = (consume("include")))) {
-                drc_include(t, 0);
-            } else if (consume("if")) {
-                cntlflow(ifcond());
-            } else if (consume("ifdef")) {
-                Token *t = consume_to_lnend();
-                cntlflow(!!macro_get(t, t->next));
-            } else if (consume("ifndef")) {
-                Token *t = consume_to_lnend();
-                cntlflow(!macro_get(t, t->next));
-            } else if (token_cmp(cur, "endif") || token_cmp(cur, "elif") ||
-                       token_cmp(cur, "else")) {
-                exit_if(is_top, cur, "no matched if-staement");
-                return;
-            } else {
-                exit_if(1, cur, "invalid token %.*s", cur->len, cur->pos);
-            }
-            continue;
-        }
-        if ((t = consume_id(TK_IDENT))) {
-            macro_org = t;
-            ocur->next = expand_macro(&t);
-            ocur = t;
+static unsigned long ckpt_fold(Macro *m) {
+    // macro table version: a rolling hash of the definitions by their text,
+    // from the one folded last
+    int n = 0;
+    for (Macro *x = m; x != ckpts.folded; x = x->next) {
+        n++;
+    }
+    Macro **ms = calloc(sizeof(Macro *), n + 1);
+    for (Macro *x = m; x != ckpts.folded; x = x->next) {
+        ms[--n] = x;
+    }
+    unsigned long h = ckpts.mstate;
+    for (; ms[n]; n++) {
+        Macro *x = ms[n];
+        h = hash_str(h, x->key);
+        if (x->undef) {
+            h = hash_str(h, "#undef");
+        } else if (x->def) {
+            char *p = x->def->pos + x->def->len;
+            h = hash_bytes(h, p, drc_define_end(p) - p);
         } else {
-            ocur = token_stitch(consume_any(), ocur);
+            unsigned long mh = macro_hash(x);
+            h = hash_bytes(h, (char *)&mh, sizeof(mh));
         }
     }
-    ocur = token_stitch(cur, ocur);
-    return;
+    free(ms);
+    ckpts.folded = m;
+    return ckpts.mstate = h;
 }
 
-static void env_push(char *path, int skips) {
-    env->pos = pos;
-    env->cur = cur;
-    Env *newe = calloc(sizeof(Env), 1);
-    newe->path = path;
-    newe->pos = newe->input = read_file(path);
-    newe->skips = skips;
-    newe->next = env;
-    env = newe;
+static Ckpt *ckpt_new(Env *e, Token *t) {
+    Ckpt *c = calloc(sizeof(Ckpt), 1);
+    c->env = *e;
+    c->cur = *t;
+    c->off = t->pos >= e->input && t->pos <= e->end ? t->pos + t->len - e->input
+                                                    : 0;
+    c->up = e->ckpt;
+    c->all = ckpts.ir->all;
+    ckpts.ir->all = c;
+    return c;
+}
 
-    pos = env->pos;
-    cur = env->cur = token_instant(TK_SPACES, "");
+static int ckpt_has(Ckpt *c, Src *s) {
+    for (; c; c = c->up) {
+        if (c->env.src == s) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-static void env_pop() {
-    env = env->next;
-    pos = env->pos;
-    cur = env->cur;
+static Src *ckpt_src(Ckpt *c, int *off) {
+    // file and offset of c after the edit
+    *off = c->off;
+    if (c->env.src != ckpts.olds) {
+        return c->env.src;
+    }
+    *off += !c->off || c->off < ckpts.pre ? 0 : ckpts.delta;
+    return ckpts.news;
 }
 
-static void macro_predefine() {
-    for (int i = 0; predefined[i].id != TK_EOF; i++) {
+static int token_same(Token *a, Token *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return a->id == b->id && a->len == b->len &&
+           memcmp(a->pos, b->pos, a->len) == 0 &&
+           token_same(a->leadings, b->leadings);
+}
+
+static int ckpt_same(Ckpt *a, Ckpt *b) {
+    // a of this run is in the state of b of the last run
+    if (a->mstate != b->mstate || a->fstate != b->fstate ||
+        a->ostate != b->ostate || a->nfiles != b->nfiles ||
+        a->nonces != b->nonces || a->nconds != b->nconds ||
+        memcmp(a->conds, b->conds, a->nconds) != 0) {
+        return 0;
+    }
+    int in = ckpt_has(b, ckpts.olds);
+    for (; a && b; a = a->up, b = b->up) {
+        int aoff, boff;
+        Env *x = &a->env, *y = &b->env;
+        if (ckpt_src(a, &aoff) != ckpt_src(b, &boff) || aoff != boff ||
+            !token_same(&a->cur, &b->cur) || x->depth != y->depth ||
+            x->skips != y->skips || x->is_sys != y->is_sys ||
+            (x->items < 2 ? x->items : 2) != (y->items < 2 ? y->items : 2) ||
+            !token_same(x->guard, y->guard)) {
+            return 0;
+        }
+    }
+    // the last run went on with the guard of the file read before the edit
+    char *og = ckpts.olds->guard, *ng = ckpts.news->guard;
+    return !a && !b && (in || (og && ng ? strcmp(og, ng) == 0 : og == ng));
+}
+
+static int ckpt_key(char *key, Ckpt *c) {
+    int off;
+    Src *s = ckpt_src(c, &off);
+    return sprintf(key, "%p %d", (void *)s, off);
+}
+
+static void ckpt_index() {
+    // old checkpoints past the edit by their position, the run can end
+    // at them. The output of the last run after them has line numbers of
+    // the old contents.
+    int start = 0;
+    for (int k = 0; k < ckpts.nold; k++) {
+        Ckpt *c = ckpts.old[k];
+        start = c->env.src == ckpts.olds && !c->off ? k : start;
+    }
+    ckpts.same = calloc(sizeof(int), ckpts.nold + 1);
+    ckpts.index = (Map){0};
+    for (int k = ckpts.nold - 1; k >= start; k--) {
+        int in = 0, past = 1;
+        for (Ckpt *c = ckpts.old[k]; c; c = c->up) {
+            if (c->env.src == ckpts.olds) {
+                in = 1;
+                past = past && c->off >= ckpts.oldend;
+            }
+        }
+        if (!past || (!ckpts.lines && (in || opts.token_stream))) {
+            continue;
+        }
+        char key[64];
+        int n = ckpt_key(key, ckpts.old[k]);
+        ckpts.same[k] = (long)map_get(&ckpts.index, key, n) - 1;
+        map_put(&ckpts.index, key, n, (void *)(long)(k + 1));
+    }
+}
+
+static int ckpt_match(Ckpt *c) {
+    char key[64];
+    int n = ckpt_key(key, c);
+    for (int k = (long)map_get(&ckpts.index, key, n) - 1; k >= 0;
+         k = ckpts.same[k]) {
+        if (ckpt_same(c, ckpts.old[k])) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+static void ckpt_add(Incr *ir, Ckpt *c) {
+    if (ir->ncps % 1024 == 0) {
+        ir->cps = realloc(ir->cps, sizeof(Ckpt *) * (ir->ncps + 1024));
+    }
+    ir->cps[ir->ncps++] = c;
+}
+
+static void ckpt_converge(int k) {
+    // the rest of the last run from old[k] on is the rest of this run
+    Incr *ir = ckpts.ir;
+    Ckpt *o = ckpts.old[k], *from = ckpts.from;
+    Token *at = o->ocur, *rest = at == from->ocur ? ckpts.rest : at->next;
+    ckpts.tail = ir->ncps;
+    for (int i = k; i < ckpts.nold; i++) {
+        Ckpt *c = ckpts.old[i];
+        c->ocur = c->ocur == at ? ocur : c->ocur; // output up to at is redone
+        ckpt_add(ir, c);
+    }
+    ocur->next = rest;
+    ocur = rest ? ckpts.last : ocur;
+    ckpts.on = 0;
+
+    // files and #pragma once the last run met after old[k]
+    File **f = &files;
+    while (*f) {
+        f = &(*f)->next;
+    }
+    *f = ckpts.ofiles;
+    for (int i = from->nfiles; i < o->nfiles && *f; i++) {
+        *f = (*f)->next;
+    }
+    for (int i = o->nonces - from->nonces; i < ckpts.noonces; i++) {
+        ir->onces = realloc(ir->onces, sizeof(char *) * (ir->nonces + 1));
+        ir->onces[ir->nonces++] = ckpts.oonces[i];
+        file_add(ckpts.oonces[i], 0)->once = 1;
+    }
+    if (ckpt_has(o, ckpts.olds)) {
+        ckpts.news->guard = ckpts.olds->guard;
+    }
+    for (File *f = files; f; f = f->next) {
+        f->guard = strcmp(f->path, ckpts.news->path) ? f->guard
+                                                     : ckpts.news->guard;
+    }
+    ckpts.done = 1;
+}
+
+static int ckpt_take(int test) {
+    // records the state at cur. With test, ends the run when it is the
+    // state of the last run at a checkpoint past the edit.
+    if (cur->next) {
+        return 0; // not at a position in the input
+    } else if (env->level > 1 && !env->ckpt) {
+        ckpts.ir->partial = 1;
+        return 0;
+    } else if (cur == ckpts.at) {
+        return 0;
+    }
+    Ckpt *c = ckpt_new(env, cur);
+    c->macro = macro;
+    c->mstate = ckpt_fold(macro);
+    c->fstate = ckpts.fstate;
+    c->ostate = ckpts.ostate;
+    c->nfiles = ckpts.nfiles;
+    c->nonces = ckpts.ir->nonces;
+    c->conds = memcpy(malloc(nconds + 1), conds, nconds);
+    c->nconds = nconds;
+    c->ocur = ocur;
+    stats.ckpts++;
+    int k = test && ckpts.nold ? ckpt_match(c) : -1;
+    if (k >= 0) {
+        ckpt_converge(k);
+        return 1;
+    }
+    ckpt_add(ckpts.ir, c);
+    return 0;
+}
+
+static int ckpt_rebase(Env *e, Token *t, int off) {
+    // e and t read olds at off, moves them to news, returns the shift
+    Src *o = ckpts.olds, *n = ckpts.news;
+    int shift = !off || off < ckpts.pre ? 0 : ckpts.delta;
+    if (t->pos >= o->input && t->pos <= e->end) {
+        t->pos = n->input + (t->pos - o->input) + shift;
+    }
+    e->src = n;
+    e->input = n->input;
+    e->end = n->input + strlen(n->input);
+    e->lines = NULL;
+    e->nlines = 0;
+    e->replay = 0;
+    return shift;
+}
+
+static int ckpt_find(Incr *ir, Src *s, int off) {
+    // last checkpoint of ir before the run read s past off, -1 if none
+    int found = -1, was = 0, prev = 0;
+    for (int i = 0; i < ir->ncps; i++) {
+        int in = 0, at = 0, past = 0;
+        for (Ckpt *c = ir->cps[i]; c; c = c->up) {
+            if (c->env.src == s) {
+                at = in ? at : c->off;
+                in = 1;
+                past = past || (c->off && c->off >= off);
+            }
+        }
+        if (past || (was && (!in || at < prev))) {
+            break;
+        }
+        found = i;
+        was = was || in;
+        prev = in ? at : prev;
+    }
+    return was ? found : -1;
+}
+
+static void ckpt_restore(Ckpt *c) {
+    // env, pos and cur as they were at c, reading news for olds
+    int n = 0;
+    for (Ckpt *x = c; x; x = x->up) {
+        n++;
+    }
+    Ckpt **xs = calloc(sizeof(Ckpt *), n);
+    for (Ckpt *x = c; x; x = x->up) {
+        xs[--n] = x;
+    }
+    for (; xs[n]; n++) {
+        Ckpt *x = xs[n];
+        Env *e = malloc(sizeof(Env));
+        *e = x->env;
+        Token *t = token_dup(&x->cur);
+        if (e->src == ckpts.olds) {
+            ckpt_rebase(e, t, x->off);
+        }
+        e->record = 0;
+        e->rec = NULL;
+        e->ckpt = x->up;
+        e->pos = e->input + x->off;
+        e->cur = t;
+        t->next = NULL;
+        t->env = e;
+        e->next = env;
+        env = e;
+        if (x == c) {
+            break;
+        }
+    }
+    free(xs);
+    pos = env->pos;
+    cur = env->cur;
+    preid = c->off ? cur->id : TK_NEWLINE; // as after #include
+}
+
+static char *stmt_skip_line(char *p, int *blank) {
+    // end of the line at p if it is no directive, the line where a comment
+    // from it ends, NULL if it may have a continuation
+    *blank = 1;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '#') {
+        return NULL;
+    }
+    for (; *p != '\n'; p++) {
+        if (!*p || *p == '\\') {
+            return NULL;
+        } else if (scmp(p, 2, "/*")) {
+            char *e = strstr(p + 2, "*/");
+            if (!e) {
+                return NULL;
+            }
+            p = e + 1;
+            continue;
+        } else if (scmp(p, 2, "//")) {
+            p += strcspn(p, "\n");
+            return *p && p[-1] != '\\' ? p + 1 : NULL;
+        } else if (*p == '"' || *p == '\'') {
+            for (int flg = 0, delim = *p++; *p != delim || flg; p++) {
+                if (!*p || *p == '\n') {
+                    return NULL;
+                }
+                flg = *p == '\\' && !flg;
+            }
+        }
+        *blank = *blank && (*p == ' ' || *p == '\t');
+    }
+    return p + 1;
+}
+
+static void stmt_skip(long *lines) {
+    // consumes cur, the rest of its line and the lines after it which are
+    // no directives, without tokens where stmt_skip_line() can tell
+    if (cur->next || cur->id == TK_EOF) {
+        consume_any();
+        return;
+    }
+    int blank = 0;
+    for (char *pe; (pe = stmt_skip_line(pos, &blank)); pos = pe) {
+        env->items += !env->depth && !blank ? 1 : 0;
+        env->nls++; // newlines in comments make no tokens either
+        (*lines)++;
+        preid = TK_NEWLINE; // for a directive at pe
+    }
+    cur = token_next();
+}
+
+static void stmt_off() {
+    // one line or token in a skipped region
+    if (!consume_id(TK_DIRECTIVE)) {
+        stats.skip_lines += cur->id == TK_NEWLINE ? 1 : 0;
+        stmt_skip(&stats.skip_lines);
+    } else if (consume("if") || consume("ifdef") || consume("ifndef")) {
+        consume_to_lnend();
+        stats.skip_lines++;
+        cond_push(IF_DEAD);
+    } else if (token_cmp(cur, "elif") || token_cmp(cur, "else") ||
+               token_cmp(cur, "endif")) {
+        cond_next(cur);
+    }
+}
+
+static void trace_skipped(int on) {
+    static double ts;
+    static Token *at;
+    trace.skipping = !on;
+    if (!on) {
+        ts = trace_now();
+        at = cur;
+    } else if (trace_now() - ts >= opts.time_trace_granularity) {
+        trace_event('X', "skipped", ts, at, NULL, 0);
+    }
+}
+
+static char *stmt_verbatim(char *p, int *blank) {
+    // end of the line at p if it can be copied as it is: it has no
+    // directive, comment, continuation or name of a possible macro
+    *blank = 1;
+    while (*p != '\n') {
+        if (!*p || *p == '#' || *p == '\\' || scmp(p, 2, "//") ||
+            scmp(p, 2, "/*")) {
+            return NULL;
+        } else if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        *blank = 0;
+        if (*p == '"' || *p == '\'') {
+            char delim = *p++;
+            for (int flg = 0; *p != delim || flg; p++) {
+                if (!*p || *p == '\n') {
+                    return NULL;
+                }
+                flg = *p == '\\' && !flg;
+            }
+            p++;
+        } else if (pp_number(p) != p) { // as token_lex()
+            p = pp_number(p);
+        } else if (isalpha(*p) || *p == '_') {
+            char *ps = p;
+            while (isalnum(*p) || *p == '_') {
+                p++;
+            }
+            if (bloom_has(ps, p - ps)) {
+                return NULL;
+            } else if (incs.active && !is_keyword(ps, p - ps)) {
+                inc_consult(ps, p - ps); // as macro_get() would
+            }
+        } else {
+            p++;
+        }
+    }
+    return p + 1;
+}
+
+static void stmt() {
+    // #if and #include nest on conds and env, not on the C stack
+    Env *top = env;
+    Token *t = NULL;
+    for (;;) {
+        int on = !env->depth || conds[nconds - 1] == IF_ON;
+        if (trace.on && on == trace.skipping) {
+            trace_skipped(on);
+        }
+        if (cur->id == TK_EOF) {
+            exit_if(env->depth, cur, "Expected token: endif");
+            ocur = token_stitch(cur, ocur);
+            if (env == top) {
+                return;
+            }
+            drc_include_end();
+            continue;
+        }
+        if (!on) {
+            stmt_off();
+            continue;
+        }
+        if (ckpts.on &&
+            (cur->id == TK_DIRECTIVE ||
+             (cur->id == TK_NEWLINE && env->nls % CKPT_LINES == 0)) &&
+            ckpt_take(1)) {
+            return; // the rest is as in the last run
+        }
+
+        if (cur->id == TK_NEWLINE && !cur->next && !opts.token_stream &&
+            !opts.deps_only) {
+            // lines after the newline need no tokens unless they may
+            // have macros
+            ocur = token_stitch(cur, ocur);
+            int blank = 0;
+            for (char *pe; (pe = stmt_verbatim(pos, &blank)); pos = pe) {
+                env->items += !env->depth && !blank ? 1 : 0;
+                env->nls++;
+                stats.verbatim_lines++;
+                ocur = token_stitch(token_new(TK_VERBATIM, pos, pe), ocur);
+            }
+            cur = token_next();
+            continue;
+        }
+        env->items += !env->depth && cur->id != TK_NEWLINE ? 1 : 0;
+        if (consume_id(TK_DIRECTIVE)) {
+            if (consume("define")) {
+                drc_define();
+            } else if (consume("undef")) {
+                macro_rm(expect_id(TK_IDENT));
+            } else if (consume("warning")) {
+                exit_if(2, consume_to_lnend(), "warning message");
+            } else if (consume("error")) {
+                exit_if(1, consume_to_lnend(), "error message");
+            } else if ((t = consume("include_next"))) {
+                drc_include(t, env->skips + 1);
+            } else if ((t = (consume("include")))) {
+                drc_include(t, 0);
+            } else if (consume("if")) {
+                cond_push(ifcond() ? IF_ON : IF_OFF);
+            } else if (consume("ifdef")) {
+                Token *t = consume_to_lnend();
+                cond_push(macro_get(t, t->next) ? IF_ON : IF_OFF);
+            } else if (consume("ifndef")) {
+                Token *t = consume_to_lnend();
+                env->guard = !env->depth && env->items == 1 ? t : env->guard;
+                cond_push(!macro_get(t, t->next) ? IF_ON : IF_OFF);
+            } else if ((t = consume("pragma"))) {
+                drc_pragma(t);
+            } else if (token_cmp(cur, "endif") || token_cmp(cur, "elif") ||
+                       token_cmp(cur, "else")) {
+                cond_next(cur);
+            } else {
+                exit_if(1, cur, "invalid token %.*s", cur->len, cur->pos);
+            }
+            continue;
+        }
+        if (opts.deps_only) {
+            stmt_skip(&stats.verbatim_lines);
+        } else if ((t = consume_id(TK_IDENT))) {
+            macro_org = t;
+            ocur->next = expand_macro(&t);
+            ocur = t;
+        } else {
+            ocur = token_stitch(consume_any(), ocur);
+        }
+    }
+}
+
+static void env_push(char *path, int skips, int is_sys) {
+    env->pos = pos;
+    env->cur = cur;
+    Env *newe = arena_alloc(sizeof(Env));
+    Src *s = newe->src = src_get(path);
+    newe->path = path;
+    newe->pos = newe->input = s->input;
+    newe->end = s->input + strlen(s->input);
+    newe->skips = skips;
+    newe->is_sys = is_sys;
+    newe->level = env->level + 1;
+    newe->replay = __atomic_load_n(&s->lexed, __ATOMIC_ACQUIRE);
+    if (opts.warm && !incs.worker && !newe->replay && s->rec_run != run) {
+        newe->record = 1;
+        s->rec_run = run;
+        src_untok(s);
+    }
+    for (Env *e = env; incs.active && e; e = e->next) {
+        if (e->rec) {
+            inc_src(e->rec->memo, s);
+        }
+    }
+    File *f = newe->file = file_add(path, is_sys);
+    if (opts.cache_dir || opts.snapshot_out) {
+        f->hash = src_hash(s);
+    }
+    if (ckpts.on && (env->level == 1 || env->ckpt) && !cur->next) {
+        newe->ckpt = ckpt_new(env, cur);
+    }
+    newe->next = env;
+    env = newe;
+
+    pos = env->pos;
+    cur = env->cur = token_instant(TK_SPACES, "");
+    if (ckpts.on) {
+        ckpt_take(0);
+    }
+}
+
+static void env_pop() {
+    env = env->next;
+    pos = env->pos;
+    cur = env->cur;
+}
+
+static void macro_predefine() {
+    // builtins unless a snapshot brought them, then -D/-U in order
+    for (int i = 0, on = !macro; on && predefined[i].id != TK_EOF; i++) {
         Predefined pd = predefined[i];
         macro_add(pd.name, NULL, token_instant(pd.id, pd.value));
     }
+    for (int i = 0; i < opts.ndefs; i++) {
+        char *d = opts.defs[i] + 1;
+        int len = 0;
+        while (isalnum(d[len]) || d[len] == '_') {
+            len++;
+        }
+        exit_if(!len, NULL, "macro names must be identifiers: %s", d);
+        if (opts.defs[i][0] == 'U') {
+            macro_rm(token_new(TK_IDENT, d, d + len));
+            continue;
+        }
+        // "name(params)=value" is lexed later as "name(params) value"
+        Env *e = calloc(sizeof(Env), 1);
+        e->path = "<command-line>";
+        char *eq = strchr(d, '=');
+        int n = eq ? eq - d : strlen(d);
+        e->input = calloc(sizeof(char), strlen(d) + 4);
+        sprintf(e->input, "%.*s %s\n", n, d, eq ? eq + 1 : "1");
+        e->end = e->input + strlen(e->input);
+        Macro *m = macro_new(strndup(d, len));
+        m->is_func = d[len] == '(';
+        m->body = e->input + len;
+        m->body_end = e->end - 1;
+        m->env = e;
+    }
+}
+
+static void print_tokens(Token *t) {
+    for (; t; t = t->next) {
+        for (Token *l = t->leadings; l; l = l->next) {
+            buf_printf(&out, "%.*s", l->len, l->pos); // spaces only
+        }
+        if (token_cmp(t, "__LINE__")) {
+            buf_printf(&out, "%d", linenum(t->macro_org));
+        } else if (token_cmp(t, "__FILE__")) {
+            buf_printf(&out, "\"%s\"", t->env->path);
+        } else {
+            char *ws = t->id == TK_LITERAL ? "\"" : t->id == TK_CH ? "'" : "";
+            buf_printf(&out, "%s%.*s%s", ws, t->len, t->pos, ws);
+        }
+    }
+}
+
+struct Compact {
+    char last;  // last char written, 0 at the beginning of a line
+    int sep;    // whitespace between tokens, dropped unless they would fuse
+    int used;   // last token came from a macro expansion
+    Env *env;   // source position of the output line for -fline-markers
+    int line;
+} __thread compact;
+
+static int token_line(Token *t) {
+    // as linenum() by a table of lines, 0 if t is not in an input
+    Env *e = t->env;
+    if (!e || !e->input || t->pos < e->input || t->pos > e->end) {
+        return 0;
+    }
+    if (!e->lines) {
+        int n = 1;
+        for (char *p = e->input; p < e->end; p++) {
+            n += *p == '\n';
+        }
+        e->lines = arena_alloc(sizeof(int) * n);
+        e->nlines = 1;
+        for (char *p = e->input; p < e->end; p++) {
+            if (*p == '\n') {
+                e->lines[e->nlines++] = p + 1 - e->input;
+            }
+        }
+    }
+    int off = t->pos - e->input, lo = 0, hi = e->nlines;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        lo = e->lines[mid] <= off ? mid : lo;
+        hi = e->lines[mid] <= off ? hi : mid;
+    }
+    return lo + 1;
+}
+
+static int compact_fuse(char a, char b) {
+    // a token ending with a and one starting with b would lex differently
+    if (isalnum(a) || a == '_') {
+        return isalnum(b) || b == '_' || b == '.' || b == '"' || b == '\'' ||
+               (strchr("eEpP", a) && (b == '+' || b == '-'));
+    }
+    char *ops = "+-*/%<>=!&|^#.:";
+    return (a == '.' && isdigit(b)) ||
+           (a && b && strchr(ops, a) && strchr(ops, b));
+}
+
+static void compact_begin(Token *t, char c) {
+    // line marker and separator before a token starting with c
+    if (!compact.last && opts.line_markers && !t->used) {
+        int line = token_line(t);
+        if (line && (!compact.env || line != compact.line ||
+                     strcmp(t->env->path, compact.env->path) != 0)) {
+            buf_printf(&out, "# %d \"%s\"\n", line, t->env->path);
+        }
+        if (line) {
+            compact.env = t->env;
+            compact.line = line;
+        }
+    }
+    if (compact.last && compact.sep && compact_fuse(compact.last, c)) {
+        buf_add(&out, " ", 1);
+    }
+    compact.sep = 0;
+}
+
+static void compact_newline(Token *t) {
+    if (compact.last) {
+        buf_add(&out, "\n", 1);
+        int line = t->used ? 0 : token_line(t);
+        compact.line = line ? line + 1 : compact.line + 1;
+        compact.env = line ? t->env : compact.env;
+    }
+    compact.last = 0;
+}
+
+static void compact_verbatim(Token *t) {
+    // a line of stmt_verbatim() has no comments nor continuations
+    char *p = t->pos, *e = t->pos + t->len - 1;
+    while (p < e) {
+        char *ps = p;
+        if (*p == ' ' || *p == '\t') {
+            compact.sep = 1;
+            p++;
+            continue;
+        } else if (*p == '"' || *p == '\'') {
+            for (int flg = 0; *++p != *ps || flg;) {
+                flg = *p == '\\' && !flg;
+            }
+            p++;
+        } else {
+            while (p < e && !strchr(" \t\"'", *p)) {
+                p++;
+            }
+        }
+        compact_begin(t, *ps);
+        buf_add(&out, ps, p - ps);
+        compact.last = p[-1];
+    }
+    compact_newline(t);
+}
+
+static void print_compact(Token *t) {
+    // whitespace only where tokens would fuse, no empty lines
+    compact = (struct Compact){0};
+    for (; t; t = t->next) {
+        // edges of an expansion are apart as well
+        compact.sep |= t->leadings || (t->used != NULL) != compact.used;
+        compact.used = t->used != NULL;
+        if (t->id == TK_NEWLINE) {
+            compact_newline(t);
+            compact.sep = 1;
+        } else if (t->id == TK_VERBATIM) {
+            compact_verbatim(t);
+        } else if (token_cmp(t, "__LINE__")) {
+            compact_begin(t, '0');
+            buf_printf(&out, "%d", linenum(t->macro_org));
+            compact.last = '0';
+        } else if (token_cmp(t, "__FILE__")) {
+            compact_begin(t, '"');
+            buf_printf(&out, "\"%s\"", t->env->path);
+            compact.last = '"';
+        } else if (t->id == TK_LITERAL || t->id == TK_CH) {
+            char *q = t->id == TK_LITERAL ? "\"" : "'";
+            compact_begin(t, *q);
+            buf_printf(&out, "%s%.*s%s", q, t->len, t->pos, q);
+            compact.last = *q;
+        } else if (t->len) {
+            compact_begin(t, *t->pos);
+            buf_add(&out, t->pos, t->len);
+            compact.last = t->pos[t->len - 1];
+        }
+    }
+    compact_newline(&(Token){0});
+}
+
+static unsigned stream_str(Map *m, struct Buf *strs, struct Buf *bytes,
+                           char *p, int len) {
+    // index of the unique string p in the string table
+    unsigned long i = (unsigned long)map_get(m, p, len);
+    if (!i) {
+        TokStr s = {bytes->len, len};
+        buf_add(bytes, p, len);
+        buf_add(strs, &s, sizeof(s));
+        map_put(m, p, len, (void *)(i = m->len + 1));
+    }
+    return i - 1;
+}
+
+static void print_stream(Token *t) {
+    // -ftoken-stream: tokens as laid out in tokstream.h
+    static unsigned char kinds[] = {
+        [TK_SPACES] = TOK_SPACES,
+        [TK_NEWLINE] = TOK_NEWLINE,
+        [TK_DIRECTIVE] = TOK_DIRECTIVE,
+        [TK_IDENT] = TOK_IDENT,
+        [TK_NUM] = TOK_NUM,
+        [TK_RESERVED] = TOK_PUNCT,
+        [TK_CH] = TOK_CHAR,
+        [TK_LITERAL] = TOK_STRING,
+        [TK_USR_SRC] = TOK_USR_HEADER,
+        [TK_SYSTEM_SRC] = TOK_SYS_HEADER,
+        [TK_VERBATIM] = TOK_VERBATIM,
+        [TK_EOF] = TOK_EOF,
+    };
+    Map m = {0}, paths = {0};
+    struct Buf recs = {0}, strs = {0}, bytes = {0}, fidx = {0}, sp = {0};
+    for (; t; t = t->next) {
+        TokRec r = {kinds[t->id], t->leadings != NULL};
+        for (Token *l = t->leadings; l; l = l->next) {
+            for (int i = 0; i < l->len && r.leading < 255; i++) {
+                r.leading += l->pos[i] == '\n'; // spaces have no other
+            }
+        }
+        sp.len = 0;
+        if (token_cmp(t, "__LINE__")) {
+            r.kind = TOK_NUM;
+            buf_printf(&sp, "%d", linenum(t->macro_org));
+        } else if (token_cmp(t, "__FILE__")) {
+            r.kind = TOK_STRING;
+            buf_printf(&sp, "\"%s\"", t->env->path);
+        } else {
+            char *q = t->id == TK_LITERAL ? "\"" : t->id == TK_CH ? "'" : "";
+            buf_printf(&sp, "%s%.*s%s", q, t->len, t->pos, q);
+        }
+        r.str = stream_str(&m, &strs, &bytes, sp.data, sp.len);
+        if ((r.line = token_line(t))) {
+            char *path = t->env->path;
+            int len = strlen(path);
+            r.file = (unsigned long)map_get(&paths, path, len);
+            if (!r.file) {
+                unsigned s = stream_str(&m, &strs, &bytes, path, len);
+                buf_add(&fidx, &s, sizeof(s));
+                map_put(&paths, path, len, (void *)(long)(paths.len + 1));
+                r.file = paths.len;
+            }
+            r.file--;
+        }
+        buf_add(&recs, &r, sizeof(r));
+    }
+    TokHeader h = {TOKSTREAM_MAGIC, recs.len / sizeof(TokRec),
+                   strs.len / sizeof(TokStr), paths.len, bytes.len};
+    buf_add(&out, &h, sizeof(h));
+    buf_add(&out, recs.data, recs.len);
+    buf_add(&out, strs.data, strs.len);
+    buf_add(&out, fidx.data, fidx.len);
+    buf_add(&out, bytes.data, bytes.len);
+}
+
+static char *cache_key(char *filepath) {
+    // main file, cwd, include paths and predefines select the entry
+    unsigned long h = hash_str(HASH_INIT, filepath);
+    char *cwd = getcwd(NULL, 0);
+    h = hash_str(h, cwd ? cwd : "");
+    h = hash_str(h, access(filepath, R_OK) == 0 ? read_file(filepath) : "");
+    for (int i = 0; i < incdir.len; i++) {
+        h = hash_str(h, incdir.dir[i]);
+    }
+    h = hash_bytes(h, (char[]){opts.compact, opts.line_markers}, 2);
+    h = hash_bytes(h, (char[]){opts.token_stream}, 1);
+    for (Macro *m = macro; m; m = m->next) {
+        macro_prep(m);
+        h = hash_bytes(hash_str(h, m->key), (char[]){m->undef}, 1);
+        for (Token *t = m->to; t; t = t->next) {
+            h = hash_bytes(h, t->pos, t->len);
+        }
+    }
+    char *key = calloc(sizeof(char), 17);
+    sprintf(key, "%016lx", h);
+    return key;
+}
+
+static char *cache_path(char *key, char *ext) {
+    char *path = mk_path(NULL, opts.cache_dir, key);
+    path = realloc(path, strlen(path) + strlen(ext) + 1);
+    return strcat(path, ext);
+}
+
+static int cache_load(char *key) {
+    // manifest lines: "<hash> <is_sys> <path>" of every file opened, and
+    // "- <path>" of every include probe that found no file
+    char *mpath = cache_path(key, ".m");
+    char *opath = cache_path(key, ".o");
+    if (access(mpath, R_OK) != 0 || access(opath, R_OK) != 0) {
+        return 0;
+    }
+    File *loaded = NULL;
+    File **tail = &loaded;
+    for (char *p = read_file(mpath), *lne; *p; p = lne + 1) {
+        unsigned long hash = 0;
+        int is_sys = 0, n = 0;
+        lne = strchr(p, '\n');
+        if (lne && strncmp(p, "- ", 2) == 0) {
+            char *path = strndup(p + 2, lne - p - 2);
+            if (access(path, F_OK) == 0) {
+                return 0; // a new file would be included
+            }
+            continue;
+        } else if (!lne || sscanf(p, "%lx %d %n", &hash, &is_sys, &n) != 2) {
+            return 0;
+        }
+        *tail = calloc(sizeof(File), 1);
+        (*tail)->path = strndup(p + n, lne - p - n);
+        (*tail)->is_sys = is_sys;
+        (*tail)->hash = hash;
+        if (access((*tail)->path, R_OK) != 0 ||
+            hash_str(HASH_INIT, read_file((*tail)->path)) != hash) {
+            return 0;
+        }
+        tail = &(*tail)->next;
+    }
+    files = loaded;
+    struct stat st = {0};
+    stat(opath, &st);
+    out.data = read_file(opath);
+    out.cap = (out.len = st.st_size) + 1; // -ftoken-stream has '\0'
+    utime(mpath, NULL); // keep recently used entries from eviction
+    utime(opath, NULL);
+    return 1;
+}
+
+typedef struct {
+    char *key;
+    long size;
+    time_t mtime;
+} CacheEntry;
+
+static int cache_entry_cmp(const void *a, const void *b) {
+    time_t ta = ((CacheEntry *)a)->mtime, tb = ((CacheEntry *)b)->mtime;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static void cache_evict() {
+    DIR *dir = opendir(opts.cache_dir);
+    if (!dir) {
+        return;
+    }
+    CacheEntry *ents = NULL;
+    int len = 0;
+    long total = 0;
+    for (struct dirent *de; (de = readdir(dir));) {
+        char *ext = strrchr(de->d_name, '.');
+        struct stat sm, so;
+        if (!ext || strcmp(ext, ".m") != 0) {
+            continue;
+        }
+        char *key = strndup(de->d_name, ext - de->d_name);
+        if (stat(cache_path(key, ".m"), &sm) != 0 ||
+            stat(cache_path(key, ".o"), &so) != 0) {
+            continue;
+        }
+        ents = realloc(ents, sizeof(CacheEntry) * (len + 1));
+        ents[len++] = (CacheEntry){key, sm.st_size + so.st_size, so.st_mtime};
+        total += sm.st_size + so.st_size;
+    }
+    closedir(dir);
+
+    qsort(ents, len, sizeof(CacheEntry), cache_entry_cmp);
+    for (int i = 0; i < len && total > opts.cache_size; i++) {
+        unlink(cache_path(ents[i].key, ".m"));
+        unlink(cache_path(ents[i].key, ".o"));
+        total -= ents[i].size;
+    }
 }
 
-static void print_tokens(Token *t) {
+static void cache_store(char *key) {
+    mkdir(opts.cache_dir, 0755);
+    char ext[32];
+    sprintf(ext, ".%d.tmp", getpid()); // concurrent runs may store same key
+    char *tmp = cache_path(key, ext);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        exit_if(2, NULL, "Can not write cache: %s", tmp);
+        return;
+    }
+    buf_write(&out, fd);
+    close(fd);
+    rename(tmp, cache_path(key, ".o"));
+
+    // manifest is written last, its presence marks a complete entry
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (File *f = files; f; f = f->next) {
+        dprintf(fd, "%016lx %d %s\n", f->hash, f->is_sys, f->path);
+    }
+    for (int i = 0; i < missing.cap; i++) {
+        if (missing.keys[i]) {
+            dprintf(fd, "- %s\n", missing.keys[i]);
+        }
+    }
+    close(fd);
+    rename(tmp, cache_path(key, ".m"));
+    cache_evict();
+}
+
+#define SNAP_VERSION 2
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned nmacros;
+    unsigned nfiles;
+    unsigned macros; // offsets from the top of snapshot
+    unsigned files;
+    unsigned out;
+    unsigned out_len;
+    unsigned strs;
+    unsigned pad;
+    unsigned long config; // include dirs the snapshot was made with
+} SnapHead;
+
+typedef struct {
+    unsigned key;
+    unsigned is_func;
+    unsigned nparams;
+    unsigned nto; // followed by SnapToken x (nparams + nto)
+} SnapMacro;
+
+typedef struct {
+    unsigned id;
+    unsigned pos;
+    unsigned len;
+    unsigned leading;
+} SnapToken;
+
+typedef struct {
+    unsigned long hash;
+    unsigned long mtime;
+    unsigned long size;
+    unsigned path;
+    unsigned guard; // 0 if none
+    unsigned is_sys;
+    unsigned once;
+} SnapFile;
+
+static unsigned snap_str(struct Buf *strs, char *p, int len) {
+    int off = buf_add(strs, p, len);
+    buf_add(strs, "", 1);
+    return off;
+}
+
+static unsigned long snap_config() {
+    unsigned long h = HASH_INIT;
+    for (int i = 0; i < incdir.len; i++) {
+        h = hash_str(h, incdir.dir[i]);
+    }
+    return h;
+}
+
+static void snap_tokens(struct Buf *b, struct Buf *strs, Token *t) {
+    for (; t; t = t->next) {
+        SnapToken st = {t->id, snap_str(strs, t->pos, t->len), t->len,
+                        t->leadings != NULL};
+        buf_add(b, &st, sizeof(st));
+    }
+}
+
+static unsigned token_count(Token *t) {
+    unsigned n = 0;
     for (; t; t = t->next) {
-        if (t->leadings) {
-            print_tokens(t->leadings);
+        n++;
+    }
+    return n;
+}
+
+static void snapshot_write(char *path) {
+    // all references are offsets, so the file can be mapped anywhere
+    struct Buf b = {0}, strs = {0};
+    SnapHead h = {"PRSN", SNAP_VERSION};
+    h.config = snap_config();
+    buf_add(&b, &h, sizeof(h));
+
+    h.macros = b.len;
+    Map gone = {0}; // names #undef-ed above
+    for (Macro *m = macro; m; m = m->next) {
+        if (m->undef || map_get(&gone, m->key, strlen(m->key))) {
+            map_put(&gone, m->key, strlen(m->key), (void *)1);
+            continue;
         }
-        if (token_cmp(t, "__LINE__")) {
-            dprintf(1, "%d", linenum(t->macro_org));
-        } else if (token_cmp(t, "__FILE__")) {
-            dprintf(1, "\"%s\"", t->env->path);
-        } else {
-            char *ws = t->id == TK_LITERAL ? "\"" : t->id == TK_CH ? "'" : "";
-            dprintf(1, "%s%.*s%s", ws, t->len, t->pos, ws);
+        h.nmacros++;
+        macro_prep(m);
+        SnapMacro sm = {snap_str(&strs, m->key, strlen(m->key)), m->is_func,
+                        token_count(m->params),
+                        token_count(m->to)};
+        buf_add(&b, &sm, sizeof(sm));
+        snap_tokens(&b, &strs, m->params);
+        snap_tokens(&b, &strs, m->to);
+    }
+
+    buf_add(&b, &h, (8 - b.len % 8) % 8); // align SnapFile
+    h.files = b.len;
+    for (File *f = files; f; f = f->next, h.nfiles++) {
+        struct stat st = {0};
+        stat(f->path, &st);
+        SnapFile sf = {f->hash,
+                       st.st_mtime,
+                       st.st_size,
+                       snap_str(&strs, f->path, strlen(f->path)),
+                       f->guard ? snap_str(&strs, f->guard, strlen(f->guard))
+                                : 0,
+                       f->is_sys,
+                       f->once};
+        buf_add(&b, &sf, sizeof(sf));
+    }
+
+    h.out = buf_add(&b, out.data, out.len);
+    h.out_len = out.len;
+    h.strs = buf_add(&b, strs.data, strs.len);
+    memcpy(b.data, &h, sizeof(h));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    exit_if(fd < 0, NULL, "Can not open file: %s", path);
+    for (int n, len = 0; len < b.len; len += n) {
+        n = write(fd, b.data + len, b.len - len);
+        exit_if(n < 0, NULL, "Can not write file: %s", path);
+    }
+    close(fd);
+}
+
+static int snap_fresh(SnapFile *sf, char *strs) {
+    struct stat st;
+    char *path = strs + sf->path;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    return (st.st_mtime == sf->mtime && st.st_size == sf->size) ||
+           hash_str(HASH_INIT, read_file(path)) == sf->hash;
+}
+
+static Token *snap_load_tokens(Token *ts, SnapToken *st, int n, Env *e) {
+    // n tokens into the array ts, spelled in the mapped snapshot
+    static Token space = {TK_SPACES, " ", 1};
+    char *strs = e->input + ((SnapHead *)e->input)->strs;
+    for (int i = 0; i < n; i++) {
+        ts[i] = (Token){st[i].id, strs + st[i].pos, st[i].len};
+        ts[i].leadings = st[i].leading ? &space : NULL;
+        ts[i].env = e;
+        ts[i].next = i + 1 < n ? ts + i + 1 : NULL;
+    }
+    stats.tokens += n;
+    return n ? ts : NULL;
+}
+
+static void snap_prep(Macro *m) {
+    // tokens of a macro of snapshot_load(), made on its first use
+    SnapMacro *sm = m->snap;
+    SnapToken *st = (SnapToken *)(sm + 1);
+    Token *ts = arena_alloc(sizeof(Token) * (sm->nparams + sm->nto + 1));
+    m->params = snap_load_tokens(ts, st, sm->nparams, m->env);
+    m->to = snap_load_tokens(ts + sm->nparams, st + sm->nparams, sm->nto,
+                             m->env);
+    m->snap = NULL;
+}
+
+static int snapshot_load(char *path) {
+    int fd = open(path, O_RDONLY);
+    exit_if(fd < 0, NULL, "Can not open file: %s", path);
+    struct stat st;
+    fstat(fd, &st);
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    SnapHead *h = (SnapHead *)base;
+    exit_if(base == MAP_FAILED || st.st_size < sizeof(SnapHead) ||
+                memcmp(h->magic, "PRSN", 4) != 0 ||
+                h->version != SNAP_VERSION,
+            NULL, "Invalid snapshot: %s", path);
+
+    char *strs = base + h->strs;
+    SnapFile *sf = (SnapFile *)(base + h->files);
+    for (int i = 0; i < h->nfiles; i++) {
+        if (h->config != snap_config() || !snap_fresh(sf + i, strs)) {
+            // fall back to preprocess the prefix header itself
+            exit_if(2, NULL, "Snapshot is stale: %s", path);
+            opts.prefix = strdup(strs + sf->path);
+            return 0;
+        }
+    }
+
+    Env *e = arena_alloc(sizeof(Env));
+    e->path = strs + sf->path;
+    e->input = base;
+
+    // tokens stay in the mapping until a macro is used, see snap_prep()
+    Macro *ms = arena_alloc(sizeof(Macro) * (h->nmacros + 1));
+    char *p = base + h->macros;
+    for (int i = 0; i < h->nmacros; i++) {
+        SnapMacro *sm = (SnapMacro *)p;
+        Macro *m = ms + i;
+        m->key = strs + sm->key;
+        m->is_func = sm->is_func;
+        m->env = e;
+        m->snap = sm;
+        m->next = i + 1 < h->nmacros ? m + 1 : NULL;
+        p = (char *)((SnapToken *)(sm + 1) + sm->nparams + sm->nto);
+    }
+    macro = h->nmacros ? ms : NULL;
+    bloom_rebuild();
+    macro_gen++;
+
+    for (int i = 0; i < h->nfiles; i++, sf++) {
+        File *f = file_add(strs + sf->path, sf->is_sys);
+        f->hash = sf->hash;
+        f->guard = sf->guard ? strs + sf->guard : NULL;
+        f->once = sf->once;
+    }
+    buf_printf(&out, "%.*s", h->out_len, base + h->out);
+    return 1;
+}
+
+static void stats_print() {
+    struct rusage ru = {0};
+    getrusage(RUSAGE_SELF, &ru);
+    dprintf(errfd, "%-24s %ld\n", "cache hits", stats.cache_hit);
+    dprintf(errfd, "%-24s %ld\n", "cache misses", stats.cache_miss);
+    dprintf(errfd, "%-24s %ld\n", "files read", stats.files_read);
+    dprintf(errfd, "%-24s %ld\n", "bytes read", stats.bytes_read);
+    dprintf(errfd, "%-24s %ld\n", "tokens", stats.tokens);
+    dprintf(errfd, "%-24s %ld\n", "tokens replayed", stats.tok_replays);
+    dprintf(errfd, "%-24s %ld\n", "macro lookups", stats.lookups);
+    dprintf(errfd, "%-24s %.1f\n", "macros walked/lookup",
+            stats.lookups ? (double)stats.lookup_walk / stats.lookups : 0.0);
+    dprintf(errfd, "%-24s %ld\n", "macros defined", stats.defines);
+    dprintf(errfd, "%-24s %ld\n", "macros undefined", stats.undefs);
+    dprintf(errfd, "%-24s %ld\n", "object expansions", stats.expand_obj);
+    dprintf(errfd, "%-24s %ld\n", "function expansions", stats.expand_func);
+    dprintf(errfd, "%-24s %ld\n", "memoized expansions", stats.memo_hits);
+    dprintf(errfd, "%-24s %ld\n", "used macro nodes", stats.used_nodes);
+    dprintf(errfd, "%-24s %ld\n", "include probes", stats.probes);
+    dprintf(errfd, "%-24s %ld\n", "access() calls", stats.accesses);
+    dprintf(errfd, "%-24s %ld\n", "lines skipped", stats.skip_lines);
+    dprintf(errfd, "%-24s %ld\n", "lines copied", stats.verbatim_lines);
+    dprintf(errfd, "%-24s %ld\n", "includes replayed", stats.inc_replays);
+    dprintf(errfd, "%-24s %ld\n", "include jobs", stats.inc_jobs);
+    dprintf(errfd, "%-24s %ld\n", "include jobs failed", stats.inc_job_fails);
+    dprintf(errfd, "%-24s %ld\n", "checkpoints", stats.ckpts);
+    dprintf(errfd, "%-24s %ld\n", "checkpoints reused", stats.ckpt_reused);
+    dprintf(errfd, "%-24s %ld\n", "output bytes", stats.out_bytes);
+    dprintf(errfd, "%-24s %ld\n", "peak rss (kb)", ru.ru_maxrss);
+}
+
+static void deps_print(struct Buf *b, char *s) {
+    for (; *s; s++) {
+        buf_printf(b, *s == ' ' ? "\\ " : *s == '$' ? "$$" : "%c", *s);
+    }
+}
+
+static char *deps_swap_ext(char *path, char *ext) {
+    // extension of the last part only, dirs and leading dots are kept
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char *dot = strrchr(base, '.');
+    int len = dot && dot > base ? dot - path : strlen(path);
+    char *s = calloc(sizeof(char), len + strlen(ext) + 1);
+    return strcat(strncpy(s, path, len), ext);
+}
+
+static void deps_write(char *filepath) {
+    // foo/bar.c => "bar.o: ..." into bar.d (-MD) or stdout (-M)
+    char *target = opts.deps_target;
+    if (!target) {
+        target = deps_swap_ext(basename(strdup(filepath)), ".o");
+    }
+    char *path = opts.deps_file;
+    if (!path && !opts.deps_only) {
+        path = deps_swap_ext(basename(strdup(filepath)), ".d");
+    }
+
+    struct Buf b = {0};
+    buf_printf(&b, "%s:", target);
+    for (File *f = files; f; f = f->next) {
+        if (opts.deps == 2 && f->is_sys) {
+            continue;
         }
+        buf_printf(&b, " \\\n ");
+        deps_print(&b, f->path);
+    }
+    buf_printf(&b, "\n");
+    if (!path) {
+        buf_add(&out, b.data, b.len);
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    exit_if(fd < 0, NULL, "Can not open file: %s", path);
+    buf_write(&b, fd);
+    close(fd);
+}
+
+static void prep_reset() {
+    // state of a preprocessing run, caches in Map are kept
+    static struct IncDir incdir0;
+    static struct Opts opts0;
+    if (!run) {
+        incdir0 = incdir;
+        opts0 = opts;
+    }
+    if (!opts.incremental && !incs.record) {
+        // neither checkpoints nor include memos refer to the last run
+        arena_free();
+    } else {
+        arena = (struct Arena){0};
     }
+    incdir = incdir0;
+    opts = opts0;
+    env = calloc(sizeof(Env), 1);
+    pos = NULL;
+    preid = TK_NEWLINE;
+    cur = ocur = macro_org = NULL;
+    macro = NULL;
+    bloom_rebuild();
+    frames = NULL;
+    nconds = 0;
+    incs.record = 0;
+    ckpts.on = 0;
+    files = NULL;
+    out.len = 0;
+    stats = (struct Stats){0};
+    optind = 0;
+    cwd = getcwd(NULL, 0);
+    run++;
 }
 
 static char *setopts(int ac, char **av) {
+    static struct option lopts[] = {
+        {"M", no_argument, NULL, 'M'},
+        {"MM", no_argument, NULL, 'm'},
+        {"MD", no_argument, NULL, 'd'},
+        {"MMD", no_argument, NULL, 'e'},
+        {"MF", required_argument, NULL, 'f'},
+        {"MT", required_argument, NULL, 't'},
+        {"fcache-dir", required_argument, NULL, 'c'},
+        {"fcache-size", required_argument, NULL, 'z'},
+        {"stats", no_argument, NULL, 's'},
+        {"fsnapshot", required_argument, NULL, 'p'},
+        {"include-snapshot", required_argument, NULL, 'i'},
+        {"server", required_argument, NULL, 'S'},
+        {"client", required_argument, NULL, 'C'},
+        {"watch", no_argument, NULL, 'W'},
+        {"ftime-trace", required_argument, NULL, 'T'},
+        {"ftime-trace-granularity", required_argument, NULL, 'g'},
+        {"fmacro-profile", optional_argument, NULL, 'P'},
+        {"fperf-counters", no_argument, NULL, 'H'},
+        {"fmax-include-depth", required_argument, NULL, 'X'},
+        {"fcompact", no_argument, NULL, 'k'},
+        {"fline-markers", no_argument, NULL, 'l'},
+        {"ftoken-stream", no_argument, NULL, 'b'},
+        {"fconfig", required_argument, NULL, 'F'},
+        {"fparallel-includes", optional_argument, NULL, 'J'},
+        {"fincremental", no_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
     int opt;
     int io = 0;
-    while ((opt = getopt(ac, av, "I:")) != -1) {
+    while ((opt = getopt_long_only(ac, av, "I:o:D:U:", lopts, NULL)) != -1) {
         switch (opt) {
         case 'I':
             memmove(incdir.dir + io + 1, incdir.dir + io,
                     sizeof(char *) * incdir.len++);
             incdir.dir[io++] = optarg;
             break;
+        case 'M':
+        case 'm':
+            opts.deps_only = 1;
+            opts.deps = opt == 'M' ? 1 : 2;
+            break;
+        case 'd':
+        case 'e':
+            opts.deps = opt == 'd' ? 1 : 2;
+            break;
+        case 'f':
+            opts.deps_file = optarg;
+            break;
+        case 't':
+            opts.deps_target = optarg;
+            break;
+        case 'c':
+            opts.cache_dir = optarg;
+            break;
+        case 'z': {
+            char *unit = NULL;
+            opts.cache_size = strtol(optarg, &unit, 10);
+            int u = tolower(*unit);
+            opts.cache_size <<= u == 'k' ? 10 : u == 'm' ? 20 : 0;
+            break;
+        }
+        case 's':
+            opts.stats = 1;
+            break;
+        case 'p':
+            opts.snapshot_out = optarg;
+            break;
+        case 'i': {
+            // getopt_long_only() takes gcc's -include for an abbreviation
+            char *o = av[optind - (optarg == av[optind - 1] ? 2 : 1)];
+            o += o[1] == '-' ? 2 : 1;
+            exit_if(strncmp(o, "include-snapshot", 16) != 0, NULL,
+                    "Unknown option: -%s, -include-snapshot file maps a "
+                    "snapshot",
+                    o);
+            opts.snapshot_in = optarg;
+            break;
+        }
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'S':
+            opts.server = optarg;
+            break;
+        case 'C':
+            opts.client = optarg;
+            break;
+        case 'W':
+            opts.watch = 1;
+            break;
+        case 'T':
+            opts.time_trace = optarg;
+            break;
+        case 'g':
+            opts.time_trace_granularity = atol(optarg);
+            break;
+        case 'P':
+            opts.macro_profile = optarg ? atoi(optarg) : 20;
+            break;
+        case 'H':
+            opts.perf_counters = 1;
+            break;
+        case 'X':
+            opts.max_include_depth = atoi(optarg);
+            break;
+        case 'k':
+            opts.compact = 1;
+            break;
+        case 'l':
+            opts.line_markers = 1;
+            break;
+        case 'b':
+            opts.token_stream = 1;
+            break;
+        case 'D':
+        case 'U':
+            opts.defs = realloc(opts.defs, sizeof(char *) * (opts.ndefs + 1));
+            opts.defs[opts.ndefs] = calloc(sizeof(char), strlen(optarg) + 2);
+            sprintf(opts.defs[opts.ndefs++], "%c%s", opt, optarg);
+            break;
+        case 'J': {
+            long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+            opts.parallel_includes = optarg ? atoi(optarg) : n > 0 ? n : 1;
+            break;
+        }
+        case 'R':
+            opts.incremental = 1;
+            break;
+        case 'F':
+            opts.configs =
+                realloc(opts.configs, sizeof(char *) * (opts.nconfigs + 1));
+            opts.configs[opts.nconfigs++] = optarg;
+            break;
         default:
-            exit_if(1, NULL, "usage: %s [-I dir] file", av[0]);
+            exit_if(1, NULL,
+                    "usage: %s [-I dir] [-D name[=value]] [-U name] "
+                    "[-o file] [-M|-MM|-MD|-MMD] "
+                    "[-MF file] [-MT target] [-fcache-dir=dir] "
+                    "[-fcache-size=n[k|m]] [-stats] [-fsnapshot=file] "
+                    "[-include-snapshot file] [-ftime-trace=file] "
+                    "[-ftime-trace-granularity=us] [-fmacro-profile[=n]] "
+                    "[-fperf-counters] [-fmax-include-depth=n] "
+                    "[-fcompact [-fline-markers]] [-ftoken-stream] "
+                    "[-fconfig=\"-D.. -U.. -o file\"]... "
+                    "[-fparallel-includes[=n]] [-fincremental] "
+                    "[--client socket] file\n"
+                    "       %s --server socket\n"
+                    "       %s --watch [-I dir] file...",
+                    av[0], av[0], av[0]);
+        }
+    }
+    incdir.nuser += io;
+    exit_if(opts.token_stream && (opts.snapshot_in || opts.snapshot_out), NULL,
+            "-ftoken-stream can not be used with snapshots");
+    exit_if(opts.incremental &&
+                (opts.cache_dir || opts.snapshot_in || opts.snapshot_out ||
+                 opts.nconfigs || opts.parallel_includes),
+            NULL,
+            "-fincremental can not be used with -fcache-dir, snapshots, "
+            "-fconfig or -fparallel-includes");
+    trace.on = opts.time_trace != NULL;
+    return optind < ac ? av[optind] : NULL;
+}
+
+static int ckpt_resume(Incr *ir) {
+    // goes on from the last checkpoint before the edit of the one file
+    // changed since the last run, 0 if it can not
+    Src *olds = NULL, *news = NULL;
+    for (int i = 0; i < ir->srcs.cap; i++) {
+        Src *s = ir->srcs.vals[i];
+        struct stat st;
+        if (!s) {
+            continue;
+        } else if (stat(s->path, &st) != 0) {
+            return 0;
+        }
+        Src *n = src_get(s->path);
+        if (n != s && olds) {
+            return 0;
+        } else if (n != s) {
+            olds = s;
+            news = n;
+        }
+    }
+    if (!olds) {
+        ocur = ir->last;
+        files = ir->files;
+        stats.ckpt_reused = ir->ncps;
+        return 1;
+    }
+
+    // bytes [pre, oldend) of olds became [pre, oldend + delta) of news
+    int olen = strlen(olds->input), nlen = strlen(news->input), pre = 0;
+    while (pre < olen && pre < nlen && olds->input[pre] == news->input[pre]) {
+        pre++;
+    }
+    int suf = 0;
+    while (suf < olen - pre && suf < nlen - pre &&
+           olds->input[olen - 1 - suf] == news->input[nlen - 1 - suf]) {
+        suf++;
+    }
+    int olines = 0, nlines = 0;
+    for (int i = pre; i < olen - suf; i++) {
+        olines += olds->input[i] == '\n';
+    }
+    for (int i = pre; i < nlen - suf; i++) {
+        nlines += news->input[i] == '\n';
+    }
+    int r = ckpt_find(ir, olds, pre);
+    if (r < 0 || ir->partial) {
+        return 0;
+    }
+    Ckpt *c = ir->cps[r];
+    ckpts.olds = olds;
+    ckpts.news = news;
+    ckpts.pre = pre;
+    ckpts.oldend = olen - suf;
+    ckpts.delta = nlen - olen;
+    ckpts.lines = olines == nlines;
+    ckpts.from = c;
+
+    // the state at c
+    ckpts.nold = ir->ncps - r - 1;
+    ckpts.old = memcpy(calloc(sizeof(Ckpt *), ckpts.nold + 1),
+                       ir->cps + r + 1, sizeof(Ckpt *) * ckpts.nold);
+    ir->ncps = ckpts.keep = r + 1;
+    ckpts.noonces = ir->nonces - c->nonces;
+    ckpts.oonces = memcpy(calloc(sizeof(char *), ckpts.noonces + 1),
+                          ir->onces + c->nonces,
+                          sizeof(char *) * ckpts.noonces);
+    ir->nonces = c->nonces;
+    macro = c->macro;
+    bloom_rebuild();
+    macro_gen++;
+    ckpts.folded = c->macro;
+    ckpts.mstate = c->mstate;
+    ckpts.fstate = c->fstate;
+    ckpts.ostate = c->ostate;
+    ckpts.nfiles = c->nfiles;
+    files = ir->files;
+    File **f = &files;
+    for (int i = 0; i < c->nfiles && *f; i++) {
+        f = &(*f)->next;
+    }
+    ckpts.ofiles = *f;
+    *f = NULL;
+    for (File *f = files; f; f = f->next) {
+        f->once = 0;
+        f->guard = strcmp(f->path, olds->path) ? f->guard : NULL;
+    }
+    for (int i = 0; i < ir->nonces; i++) {
+        file_add(ir->onces[i], 0)->once = 1;
+    }
+    nconds = c->nconds;
+    conds = realloc(conds, (nconds / 64 + 1) * 64);
+    memcpy(conds, c->conds, nconds);
+    ocur = c->ocur;
+    ckpts.rest = ocur->next;
+    ckpts.last = ir->last;
+    ckpt_index();
+
+    Env *base = env;
+    ckpt_restore(c);
+    ckpts.at = cur;
+    ckpts.on = 1;
+    for (stmt(); !ckpts.done && env->level > 1; stmt()) {
+        drc_include_end();
+    }
+    env = base;
+    ckpts.on = 0;
+    if (!ckpts.done) {
+        ckpts.tail = ir->ncps;
+    }
+
+    // checkpoints kept refer to olds, which was replaced by news
+    for (int i = 0; i < ir->ncps; i++) {
+        for (Ckpt *x = ir->cps[i]; x; x = x->up) {
+            if (x->env.src == olds) {
+                x->off += ckpt_rebase(&x->env, &x->cur, x->off);
+            }
+        }
+    }
+    incr_hold(ir, news);
+    stats.ckpt_reused = ckpts.keep + ir->ncps - ckpts.tail;
+    free(ckpts.old);
+    free(ckpts.same);
+    free(ckpts.oonces);
+    map_free(&ckpts.index);
+    ir->resumes++;
+    return 1;
+}
+
+static void incr_clear(Incr *ir) {
+    // frees the checkpoints of ir and lets go of the files it read
+    for (Ckpt *c = ir->all, *next; c; c = next) {
+        next = c->all;
+        free(c->conds);
+        free(c);
+    }
+    for (int i = 0; i < ir->srcs.cap; i++) {
+        Src *s = ir->srcs.vals[i];
+        if (s) {
+            s->refs--;
+            src_release(s);
+        }
+    }
+    for (int i = 0; i < ir->nolds; i++) {
+        ir->olds[i]->refs--;
+        src_release(ir->olds[i]);
+    }
+    map_free(&ir->srcs);
+    free(ir->olds);
+    free(ir->cps);
+    free(ir->onces);
+    *ir = (Incr){0};
+}
+
+static void incr_evict() {
+    // makes room in incrs for one more, dropping the least recently run
+    int n = 0, lru = -1;
+    for (int i = 0; i < incrs.cap; i++) {
+        Incr *ir = incrs.vals[i];
+        if (ir) {
+            n++;
+            lru = lru < 0 || ir->used < ((Incr *)incrs.vals[lru])->used ? i
+                                                                         : lru;
+        }
+    }
+    if (n >= INCR_MAX) {
+        Incr *ir = incrs.vals[lru];
+        incr_clear(ir);
+        free(ir);
+        incrs.vals[lru] = NULL;
+    }
+}
+
+static char *incr_key(char *filepath) {
+    // runs with the same key resume each other
+    unsigned long h = hash_str(HASH_INIT, filepath);
+    h = hash_str(h, cwd ? cwd : "");
+    for (int i = 0; i < incdir.len; i++) {
+        h = hash_str(h, incdir.dir[i]);
+    }
+    for (int i = 0; i < opts.ndefs; i++) {
+        h = hash_str(h, opts.defs[i]);
+    }
+    h = hash_bytes(h,
+                   (char[]){opts.compact, opts.line_markers, opts.token_stream,
+                            opts.deps_only},
+                   4);
+    h = hash_bytes(h, (char *)&opts.max_include_depth, sizeof(int));
+    char *key = calloc(sizeof(char), 17);
+    sprintf(key, "%016lx", h);
+    return key;
+}
+
+static Token *incr_run(char *filepath) {
+    // -fincremental: output of filepath, resuming the last run of it
+    char *key = incr_key(filepath);
+    Incr *ir = map_get(&incrs, key, strlen(key));
+    if (!ir) {
+        incr_evict();
+        ir = calloc(sizeof(Incr), 1);
+        map_put(&incrs, key, strlen(key), ir);
+    }
+    free(key);
+    ckpts = (struct Ckpts){.ir = ir};
+    int ok = ir->ok && ir->resumes < INCR_RESUMES;
+    ir->ok = 0; // until this run completes
+    if (!ok || !ckpt_resume(ir)) {
+        incr_clear(ir);
+        ckpts = (struct Ckpts){.ir = ir, .mstate = HASH_INIT,
+                               .fstate = HASH_INIT, .ostate = HASH_INIT};
+        for (File *f = files; f; f = f->next) {
+            ckpts.nfiles++;
+            ckpts.fstate = hash_str(ckpts.fstate, f->path);
+        }
+        ckpts.on = 1;
+        ocur = &ir->head;
+        env_push(filepath, 0, 0);
+        stmt();
+        env_pop();
+        ckpts.on = 0;
+    }
+    ir->last = ocur;
+    ir->files = files;
+    ir->used = run;
+    ir->ok = 1;
+    return &ir->head;
+}
+
+static void preprocess(char *filepath) {
+    if (opts.perf_counters && !perf.fd) {
+        perf_open();
+    }
+    file_add(filepath, 0); // main file leads the dependency list
+    if (opts.snapshot_in) {
+        snapshot_load(opts.snapshot_in);
+    }
+    macro_predefine();
+    incs.record |= opts.warm && opts.parallel_includes > 0;
+    incs.dead = calloc(sizeof(int), 1);
+    int trace_len = trace.buf.len;
+
+    char *key = opts.cache_dir && !opts.deps_only && !opts.snapshot_out
+                    ? cache_key(filepath)
+                    : NULL;
+    map_free(&missing);
+    if (key && cache_load(key)) {
+        stats.cache_hit++;
+    } else {
+        stats.cache_miss += key ? 1 : 0;
+        Token head = {0}, *first = &head;
+        ocur = &head;
+        if (opts.prefix) {
+            env_push(opts.prefix, 0, 0);
+            stmt();
+            env_pop();
+        }
+        if (opts.incremental && opts.warm) {
+            first = incr_run(filepath);
+        } else {
+            env_push(filepath, 0, 0);
+            stmt();
+            env_pop();
+        }
+        if (incs.jobs && !jobs_join()) {
+            // a worker did other than predicted, so did this run after it
+            // and the rerun counts and traces the run anew
+            *incs.dead = 1;
+            macro = NULL;
+            files = NULL;
+            bloom_rebuild();
+            trace.buf.len = trace_len;
+            stats = (struct Stats){.inc_jobs = stats.inc_jobs,
+                                   .inc_job_fails = stats.inc_job_fails};
+            incs.nojobs = 1;
+            preprocess(filepath);
+            incs.nojobs = 0;
+            return;
+        }
+
+        if (!opts.deps_only) {
+            double ts = trace.on ? trace_now() : 0;
+            int phase = perf.on ? perf_switch(PH_OUTPUT) : 0;
+            if (opts.token_stream) {
+                print_stream(first->next);
+            } else if (opts.compact) {
+                print_compact(first->next);
+            } else {
+                print_tokens(first->next);
+            }
+            if (perf.on) {
+                perf_switch(phase);
+            }
+            if (trace.on) {
+                trace_event('X', "print_tokens", ts, NULL, NULL, 0);
+            }
+        }
+        if (key) {
+            cache_store(key);
+        }
+    }
+
+    if (opts.deps) {
+        deps_write(filepath);
+    }
+    stats.out_bytes = out.len;
+    if (opts.snapshot_out) {
+        snapshot_write(opts.snapshot_out);
+        out.len = 0;
+    }
+    if (trace.on) {
+        trace_write();
+    }
+    if (opts.macro_profile) {
+        prof_print();
+    }
+    if (perf.on) {
+        perf_print();
+    }
+}
+
+static void output_write() {
+    int fd = opts.output ? open(opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                         : 1;
+    exit_if(fd < 0, NULL, "Can not open file: %s", opts.output);
+    buf_write(&out, fd);
+    if (fd != 1) {
+        close(fd);
+    }
+}
+
+static int sock_io(int fd, void *p, unsigned len, int is_write) {
+    for (int n; len > 0; len -= n, p = (char *)p + n) {
+        n = is_write ? write(fd, p, len) : read(fd, p, len);
+        if (n <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void server_request(int fd) {
+    // request: length, then cwd and argv as '\0' separated strings
+    unsigned len = 0;
+    if (!sock_io(fd, &len, sizeof(len), 0)) {
+        return;
+    }
+    char *req = calloc(sizeof(char), len + 1);
+    if (!sock_io(fd, req, len, 0)) {
+        return;
+    }
+    int ac = 0;
+    char **av = calloc(sizeof(char *), len + 1);
+    for (char *p = req + strlen(req) + 1; p < req + len; p += strlen(p) + 1) {
+        av[ac++] = p;
+    }
+
+    prep_reset();
+    FILE *err = tmpfile();
+    errfd = fileno(err);
+    jmp_buf jb;
+    unsigned res[3] = {0}; // status, output length, error length
+    if (chdir(req) != 0) {
+        dprintf(errfd, "Can not change directory: %s\n", req);
+        res[0] = 1;
+    } else if (setjmp(jb) == 0) {
+        recover = &jb;
+        char *filepath = setopts(ac, av);
+        exit_if(!filepath, NULL, "Missing file name");
+        opts.warm = 1; // prep_reset() brought back the options of main()
+        preprocess(filepath);
+        if (opts.output) {
+            output_write();
+            out.len = 0;
+        }
+        if (opts.stats) {
+            stats_print();
+        }
+    } else {
+        res[0] = 1;
+    }
+    recover = NULL;
+    errfd = 2;
+
+    res[1] = out.len;
+    res[2] = lseek(fileno(err), 0, SEEK_END);
+    char *errs = calloc(sizeof(char), res[2] + 1);
+    lseek(fileno(err), 0, SEEK_SET);
+    sock_io(fileno(err), errs, res[2], 0);
+    fclose(err);
+    if (sock_io(fd, res, sizeof(res), 1) && sock_io(fd, out.data, res[1], 1)) {
+        sock_io(fd, errs, res[2], 1);
+    }
+}
+
+static int server_run(char *path) {
+    struct sockaddr_un addr = {AF_UNIX};
+    exit_if(strlen(path) >= sizeof(addr.sun_path), NULL,
+            "Too long socket path: %s", path);
+    strcpy(addr.sun_path, path);
+    int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    exit_if(bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+                listen(sfd, 64) != 0,
+            NULL, "Can not listen on: %s", path);
+    signal(SIGPIPE, SIG_IGN);
+    opts.warm = 1;
+    for (int fd; (fd = accept(sfd, NULL, NULL)) >= 0; close(fd)) {
+        server_request(fd);
+    }
+    return EXIT_FAILURE;
+}
+
+static int client_run(char *path, int ac, char **av) {
+    // returns -1 when no server is there to fall back to local run
+    struct sockaddr_un addr = {AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct Buf req = {0};
+    char *cwd = getcwd(NULL, 0);
+    buf_add(&req, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < ac; i++) {
+        buf_add(&req, av[i], strlen(av[i]) + 1);
+    }
+    unsigned res[3] = {1, 0, 0};
+    if (!sock_io(fd, &req.len, sizeof(unsigned), 1) ||
+        !sock_io(fd, req.data, req.len, 1) ||
+        !sock_io(fd, res, sizeof(res), 0)) {
+        close(fd);
+        return -1;
+    }
+    char *buf = malloc(res[1] + res[2] + 1);
+    sock_io(fd, buf, res[1] + res[2], 0);
+    close(fd);
+    sock_io(1, buf, res[1], 1);
+    sock_io(2, buf + res[1], res[2], 1);
+    return res[0] ? EXIT_FAILURE : 0;
+}
+
+typedef struct {
+    char *path;
+    char **deps; // realpath of every file opened by last run
+    int ndeps;
+} Unit;
+
+static void watch_build(Unit *u, int ac, char **av) {
+    prep_reset();
+    jmp_buf jb;
+    if (setjmp(jb) == 0) {
+        recover = &jb;
+        setopts(ac, av);
+        opts.warm = 1;
+        opts.output = deps_swap_ext(u->path, ".i");
+        exit_if(strcmp(opts.output, u->path) == 0, NULL,
+                "Output would overwrite the input: %s", u->path);
+        preprocess(u->path);
+        output_write();
+        dprintf(errfd, "%s => %s\n", u->path, opts.output);
+    }
+    recover = NULL;
+
+    // files opened before an error are still watched to retry
+    u->ndeps = 0;
+    for (File *f = files; f; f = f->next) {
+        char *rp = realpath(f->path, NULL);
+        if (rp) {
+            u->deps = realloc(u->deps, sizeof(char *) * (u->ndeps + 1));
+            u->deps[u->ndeps++] = rp;
+        }
+    }
+}
+
+static void watch_deps(int ifd, Unit *u, Map *wds, char ***wdirs) {
+    // watch dirs, not files, to catch editors replacing files by rename
+    for (int i = 0; i < u->ndeps; i++) {
+        char *dir = dirname(strdup(u->deps[i]));
+        if (map_get(wds, dir, strlen(dir))) {
+            continue;
+        }
+        int wd = inotify_add_watch(ifd, dir,
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                       IN_DELETE);
+        exit_if(wd < 0, NULL, "Can not watch: %s", dir);
+        map_put(wds, dir, strlen(dir), dir);
+        *wdirs = realloc(*wdirs, sizeof(char *) * (wd + 1));
+        (*wdirs)[wd] = dir;
+    }
+}
+
+static int watch_run(int ac, char **av, int first) {
+    int ifd = inotify_init1(0);
+    exit_if(ifd < 0, NULL, "Can not use inotify");
+    Map wds = {0};
+    char **wdirs = NULL;
+    int nunits = ac - first;
+    Unit *units = calloc(sizeof(Unit), nunits);
+    for (int i = 0; i < nunits; i++) {
+        units[i].path = av[first + i];
+        watch_build(units + i, ac, av);
+        watch_deps(ifd, units + i, &wds, &wdirs);
+    }
+
+    char buf[4096] __attribute__((aligned(8)));
+    for (int len; (len = read(ifd, buf, sizeof(buf))) > 0;) {
+        // gather a burst of events, e.g. several files saved at once
+        Map changed = {0};
+        struct pollfd pfd = {ifd, POLLIN};
+        do {
+            struct inotify_event *ev;
+            for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+                ev = (struct inotify_event *)p;
+                if (ev->len) {
+                    char *path = mk_path(NULL, wdirs[ev->wd], ev->name);
+                    map_put(&changed, path, strlen(path), path);
+                }
+            }
+        } while (poll(&pfd, 1, 50) > 0 &&
+                 (len = read(ifd, buf, sizeof(buf))) > 0);
+
+        for (int i = 0; i < nunits; i++) {
+            int j = 0;
+            while (j < units[i].ndeps &&
+                   !map_get(&changed, units[i].deps[j],
+                            strlen(units[i].deps[j]))) {
+                j++;
+            }
+            if (j < units[i].ndeps) {
+                watch_build(units + i, ac, av);
+                watch_deps(ifd, units + i, &wds, &wdirs);
+            }
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+static int configs_run(int ac, char **av) {
+    // one run per -fconfig: files are lexed once (opts.warm) and includes
+    // that look up the same macros are replayed, see inc_find()
+    char **configs = opts.configs;
+    int n = opts.nconfigs;
+    for (int i = 0; i < n; i++) {
+        prep_reset();
+        char *filepath = setopts(ac, av);
+        char *cav[64] = {av[0]};
+        int cac = 1;
+        for (char *p = strtok(strdup(configs[i]), " \t"); p && cac < 63;
+             p = strtok(NULL, " \t")) {
+            cav[cac++] = p;
+        }
+        optind = 0;
+        exit_if(setopts(cac, cav) != NULL, NULL,
+                "-fconfig takes options only: %s", configs[i]);
+        opts.warm = 1;
+        incs.record = i + 1 < n;
+        preprocess(filepath);
+        output_write();
+        if (opts.stats) {
+            stats_print();
         }
     }
-    exit_if(optind >= ac, NULL, "Missing file name");
-    return av[optind];
+    return 0;
 }
 
 int main(int ac, char **av) {
 
-    env = calloc(sizeof(Env), 1);
+    // errorcheck, so workers can unlock it after errors whether held or not
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_settype(&ma, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&shared, &ma);
     keywords_init();
-    macro_predefine();
+    prep_reset();
     char *filepath = setopts(ac, av);
+    if (opts.server) {
+        return server_run(opts.server);
+    }
+    exit_if(!filepath, NULL, "Missing file name");
+    if (opts.nconfigs) {
+        return configs_run(ac, av);
+    }
+    if (opts.watch) {
+        return watch_run(ac, av, optind);
+    }
 
-    env_push(filepath, 0);
-    Token head = {0};
-    ocur = &head;
-    stmt(1);
-    env_pop();
-
-    print_tokens(head.next);
+    int status = opts.client ? client_run(opts.client, ac, av) : -1;
+    if (status >= 0) {
+        return status;
+    }
+    preprocess(filepath);
+    output_write();
+    if (opts.stats) {
+        stats_print();
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -15,3 +15,11 @@ A
 B
 #endif
 
+
+#if A == 2
+A2
+#elif A == 3
+A3
+#else
+A4
+#endif
@@ -0,0 +1,11 @@
+#include "inc/guarded.h"
+#include "inc/once.h"
+#include "inc/noguard.h"
+#include "inc/tail.h"
+#include "inc/guarded.h"
+#include "inc/once.h"
+#include "inc/noguard.h"
+#include "inc/tail.h"
+#undef GUARDED
+#include "inc/guarded.h"
+GUARDED ONCE
@@ -0,0 +1,4 @@
+#ifndef GUARDED
+#define GUARDED 1
+int guarded;
+#endif
@@ -0,0 +1,6 @@
+#ifndef NOGUARD
+#define NOGUARD
+int first;
+#else
+int again;
+#endif
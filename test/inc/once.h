@@ -0,0 +1,3 @@
+#pragma once
+#define ONCE 2
+int once;
@@ -0,0 +1,4 @@
+#ifndef TAIL
+#define TAIL
+#endif
+int tail;
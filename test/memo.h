@@ -0,0 +1,22 @@
+// memoized object-like macros, used thrice so the third use replays the
+// memo, expand anew once a macro they use changed
+#define X Y + 1
+#define Y 1
+X X X
+#undef Y
+#define Y 2
+X X X
+#undef Y
+X X X
+#define Y 3
+X X X
+// X expanded inside Z, under another hideset
+#define Z X Z
+Z Z Z
+#undef X
+#define X 4
+X Z
+// a memo of __LINE__ gives the line of each use
+#define L __LINE__ Y
+L L L
+L
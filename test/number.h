@@ -0,0 +1,13 @@
+// pp-numbers are one token, and pasting may give one
+#define CAT(a, b) a##b
+CAT(1e, +) CAT(., 5) CAT(1, .) CAT(0x1p, -) CAT(1, e) CAT(.5, e+)
+// no macro expands inside a pp-number
+#define e 3
+#define L 4
+int a = 1e;
+long b = 10L;
+double c = 1.5e+3 + .5e-2 + 0x1p-3;
+int d = 1.e;
+#if 0x10 == 16 && 010 == 8 && 10UL == 10
+int hex;
+#endif
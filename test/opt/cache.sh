@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# cache.sh prep: -fcache-dir gives the output of a plain run, from the
+# cache while nothing it depends on changed.
+
+. `dirname $0`/lib.sh
+
+mkdir $tmp/d1 $tmp/d2
+printf '#define N 1\nint h = N;\n' > $tmp/d2/h.h
+printf '#include "h.h"\nint m = N;\n' > $tmp/m.c
+cd $tmp
+run() {
+    $prep -I d1 -I d2 -fcache-dir=cache "$@" m.c
+}
+
+diff <(run) <($prep -I d1 -I d2 m.c) &&
+    [[ `stat "cache hits" -I d1 -I d2 -fcache-dir=cache m.c` == 1 ]]
+check "cache hit"
+
+printf '#define N 2\nint h = N;\n' > d2/h.h
+diff <(run) <($prep -I d1 -I d2 m.c)
+check "cache invalidated by an edited header"
+
+# found earlier in the include path than the cached one
+printf '#define N 3\nint h1 = N;\n' > d1/h.h
+diff <(run) <($prep -I d1 -I d2 m.c)
+check "cache invalidated by a new header"
+
+rm -rf cache
+run -fcache-size=1K > /dev/null
+[[ `stat "cache hits" -I d1 -I d2 -fcache-dir=cache -fcache-size=1K m.c` == 1 ]]
+check "-fcache-size with an upper case unit"
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# compact.sh prep: -fcompact keeps the tokens of the output but no blank
+# lines and no spaces tokens do not need, -fline-markers adds where lines
+# come from.
+
+. `dirname $0`/lib.sh
+
+# the same tokens lex from both when compacting them again gives the same
+for file in test/*.h; do
+    $prep $file > $tmp/plain.i 2> /dev/null
+    $prep -fcompact $file > $tmp/compact.i 2> /dev/null
+    diff <($prep -fcompact $tmp/plain.i) <($prep -fcompact $tmp/compact.i) \
+        > /dev/null && ! grep -q '^$' $tmp/compact.i
+    check "-fcompact $file"
+done
+
+printf 'int h1;\n\nint h2;\n' > $tmp/h.h
+cat > $tmp/m.c << 'END'
+#define CAT(a, b) a b
+int  a =  - -1;
+
+
+
+int b = CAT(+, +) CAT(x, 1) CAT(-, =) CAT(., 5);
+#include "h.h"
+int c;
+END
+cd $tmp
+diff - <($prep -fcompact -fline-markers m.c) << 'END'
+# 2 "m.c"
+int a= - -1;
+# 6 "m.c"
+int b= + +x 1- = . 5;
+# 1 "./h.h"
+int h1;
+# 3 "./h.h"
+int h2;
+# 8 "m.c"
+int c;
+END
+check "-fline-markers"
@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# config.sh prep: -D/-U act as in gcc, in order, and each -fconfig gives
+# the output of a plain run with its options.
+
+. `dirname $0`/lib.sh
+
+printf '#pragma once\nint fixed;\n' > $tmp/fixed.h
+cat > $tmp/dep.h << 'END'
+#ifdef A
+int a = A;
+#else
+int no_a;
+#endif
+#define FROM_DEP B
+END
+cat > $tmp/m.c << 'END'
+#include "fixed.h"
+#include "dep.h"
+int b = FROM_DEP, c = C + 0;
+#if defined(__STDC__)
+int stdc;
+#endif
+END
+cd $tmp
+
+for defs in "-DA" "-DA=2 -UA" "-UA -DA=3" "-DB=x -DC= -U__STDC__" "-DA -DA=4"
+do
+    diff -w -B <(gcc -E -P $defs m.c 2> /dev/null) <($prep $defs m.c)
+    check "$defs"
+done
+
+$prep -DB=1 -fconfig="-DA -o a.i" -fconfig="-DA=2 -DC=3 -o b.i" \
+    -fconfig="-UB -o c.i" m.c &&
+    diff a.i <($prep -DB=1 -DA m.c) &&
+    diff b.i <($prep -DB=1 -DA=2 -DC=3 m.c) &&
+    diff c.i <($prep -DB=1 -UB m.c)
+check "-fconfig outputs"
+
+# fixed.h looks up no macro that differs, so later configurations replay it
+replays=`$prep -stats -fconfig="-DA -o a.i" -fconfig="-DA=2 -o b.i" m.c 2>&1 |
+    awk -F '  +' '$1 == "includes replayed" { n += $2 } END { print n }'`
+[[ $replays -gt 0 ]]
+check "-fconfig replays includes"
@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# define.sh prep: #define bodies lexed on first expansion report their
+# errors at the definition, used or not.
+
+. `dirname $0`/lib.sh
+
+# error of a file defining $1 and never using it
+error() {
+    printf '%s\nint x;\n' "$1" > $tmp/d.c
+    $prep $tmp/d.c 2>&1 > /dev/null | head -1
+}
+[[ `error '#define S x "abc'` == *"No closing quote" ]]
+check "unterminated string"
+[[ `error '#define F(a) # b'` == *"No following parameter to '#'" ]]
+check "'#' without a parameter"
+[[ `error '#define F(a) ## a'` == *"Bad use of '##'" &&
+   `error '#define F(a) a ##'` == *"Bad use of '##'" ]]
+check "'##' at either end"
+[[ `error '#define F(a,) a'` == *"Expected param name" ]]
+check "empty parameter"
+
+printf '%s\n' '#define F(a, ...) #a a##1 #__VA_ARGS__' '#define G(a) a' \
+    'F(x, y) G(2)' > $tmp/d.c
+[[ `$prep $tmp/d.c 2> /dev/null | tr -d '\n'` == '"x" x1 "y" 2' ]]
+check "valid bodies"
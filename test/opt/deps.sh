@@ -0,0 +1,39 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# deps.sh prep: -M/-MM print make dependencies instead of the output,
+# -MD/-MMD write them to a file next to the output.
+
+. `dirname $0`/lib.sh
+
+mkdir $tmp/sub
+printf '#include "sub/g.h"\n' > $tmp/h.h
+printf '#pragma once\nint g;\n' > $tmp/sub/g.h
+printf '#include "h.h"\n#include <errno.h>\n#include "h.h"\nint m;\n' \
+    > $tmp/m.c
+cd $tmp
+# dependencies as one line
+deps() {
+    tr -d '\\\n' < ${1:-/dev/stdin} | tr -s ' '
+}
+
+[[ `$prep -M m.c | deps` == "m.o: m.c ./h.h ./sub/g.h /usr/include/errno.h"* ]]
+check "-M lists system headers"
+[[ `$prep -MM m.c | deps` == "m.o: m.c ./h.h ./sub/g.h" ]]
+check "-MM leaves system headers out"
+
+diff <($prep -MD m.c) <($prep m.c) &&
+    [[ `deps m.d` == "m.o: m.c ./h.h ./sub/g.h /usr/include/errno.h"* ]]
+check "-MD writes m.d beside the output"
+$prep -MMD -MF out.d -MT 'obj/m.o' m.c > /dev/null &&
+    [[ `deps out.d` == "obj/m.o: m.c ./h.h ./sub/g.h" ]]
+check "-MMD with -MF and -MT"
+
+# lines -M skips without tokens around ones it has to lex
+printf '%s\n' 'int a; /* a comment' '#include "no.h"' '*/ int b;' \
+    'char *s = "/*"; // */' '#if 0' 'x /*' '#include "no.h"' '*/' \
+    '#define X \' '#include "no.h"' '#endif' '  #include "h.h"' > skip.c
+[[ `$prep -MM skip.c | deps` == "skip.o: skip.c ./h.h ./sub/g.h" ]]
+check "-M sees directives only outside comments and continuations"
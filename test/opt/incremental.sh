@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# incremental.sh prep: -fincremental requests after edits of the main file
+# and its headers give the output of fresh local runs.
+
+. `dirname $0`/lib.sh
+server_start
+cd $tmp
+
+# file contents from the arguments, one line each, with a new mtime
+stamp=`date +%s`
+put() {
+    local file=$1
+    shift
+    printf '%s\n' "$@" > $file
+    touch -d @$((stamp += 2)) $file
+}
+
+# each request with and without compact output and line markers
+request() {
+    for opt in "" "-fcompact -fline-markers"; do
+        diff <($prep $opt m.c 2>&1) \
+            <($prep --client sock -fincremental $opt m.c 2>&1)
+        check "incremental $opt: $1"
+    done
+}
+
+body() {
+    for ((i = 0; i < 80; i++)); do
+        echo "int $1$i = N + $i;"
+    done
+}
+
+put a.h '#ifndef A_H' '#define A_H' '#define N 1' 'int a;' '#endif'
+put b.h '#pragma once' '#define M(x) (x * N)' '#include "c.h"' 'int b = M(2);'
+put c.h '#define C 1' 'int c = C;'
+put m.c '#include "a.h"' '#include "b.h"' "`body x`" '#include "a.h"' \
+    '#include "b.h"' '#if N == 1' 'int one;' '#else' 'int other;' '#endif' \
+    "`body y`" 'M(N)'
+request "first run"
+request "no change"
+
+sed -i 's/int x70 = N + 70;/int x70 = N - 70;/' m.c
+touch -d @$((stamp += 2)) m.c
+[[ `stat "checkpoints reused" --client sock -fincremental m.c` \
+    -gt 0 ]]
+check "incremental resumes after an edit"
+request "main file edited in place"
+
+sed -i 's/int x10 = N + 10;/int x10;\nint x10b;/' m.c
+touch -d @$((stamp += 2)) m.c
+request "main file with a line more"
+
+sed -i '/int x20 = N + 20;/d' m.c
+touch -d @$((stamp += 2)) m.c
+request "main file with a line less"
+
+put a.h '#ifndef A_H' '#define A_H' '/* more */' '#define N 2' 'int a;' \
+    '#endif'
+request "header with a line more, changing #if"
+
+sed -i 's/int y5 = N + 5;/#undef N\n#define N 3\nint y5 = N + 5;/' m.c
+touch -d @$((stamp += 2)) m.c
+request "#undef in the main file"
+
+put a.h '#define N 1' 'int a;'
+request "include guard removed"
+
+put a.h '#ifndef A_H' '#define A_H' '#define N 1' 'int a;' '#endif'
+request "include guard back"
+
+put b.h '#define M(x) (x * N)' '#include "c.h"' 'int b = M(2);'
+request "#pragma once removed"
+
+put b.h '#pragma once' '#define M(x) (x + N)' '#include "c.h"' \
+    'int b = M(2);'
+request "#pragma once back"
+
+put c.h '#define C 2' '#if C == 2' 'int c2;' '#endif' 'int c = C;'
+request "header included by an unchanged one"
+
+sed -i '1i #undef N' b.h
+touch -d @$((stamp += 2)) b.h
+request "#undef in a header"
+
+sed -i 's/int y9 = N + 9;/#define R 1\n#define R 2\n#undef R\nint y9 = R;/' m.c
+touch -d @$((stamp += 2)) m.c
+request "#undef after a redefinition"
+$prep --client sock -fincremental m.c | grep -q "int y9 = R;"
+check "#undef after a redefinition leaves no definition"
@@ -0,0 +1,36 @@
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# sourced by test/opt/*.sh, which are run from the top directory with the
+# prep to test as $1. $tmp is a scratch directory removed on exit.
+
+prep=`realpath ${1:-./prep}`
+tmp=`mktemp -d`
+trap "rm -rf $tmp" EXIT
+
+# prints PASS or FAIL by the status of the last command
+check() {
+    if [[ $? -eq 0 ]] then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+    fi
+}
+
+# starts a server on $tmp/sock, stopped on exit
+server_start() {
+    $prep --server $tmp/sock 2> /dev/null &
+    trap "kill $!; rm -rf $tmp" EXIT
+    while [[ ! -S $tmp/sock ]]; do
+        sleep 0.1
+    done
+}
+
+# value of a -stats counter printed by a run
+stat() {
+    local name=$1
+    shift
+    $prep "$@" -stats 2>&1 > /dev/null | awk -F '  +' -v n="$name" '
+        $1 == n { print $2 }'
+}
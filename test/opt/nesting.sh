@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# nesting.sh prep: deep macro expansion, #if and #include nesting run on a
+# small C stack, and -fmax-include-depth limits #include nesting.
+
+. `dirname $0`/lib.sh
+
+# gives the output of gcc -E -P on a 256k stack
+same() {
+    diff -q -w -B <(gcc -E -P "$@") <(ulimit -s 256; $prep "$@") > /dev/null
+}
+
+for i in {1..3000}; do
+    echo "#define M$i M$((i - 1))"
+done > $tmp/chain.h
+echo "M3000" >> $tmp/chain.h
+same $tmp/chain.h
+check "macro chain of 3000"
+
+{
+    echo '#define A(x) (x)'
+    printf 'A(%.0s' {1..2000}
+    printf '1'
+    printf ')%.0s' {1..2000}
+    echo
+} > $tmp/args.h
+same $tmp/args.h
+check "arguments nested 2000 deep"
+
+{
+    printf '#if 1\n%.0s' {1..5000}
+    echo 'int deep;'
+    printf '#endif\n%.0s' {1..5000}
+} > $tmp/if.h
+same $tmp/if.h
+check "#if nested 5000 deep"
+
+for i in {1..299}; do
+    printf '#include "i%d.h"\n' $((i + 1)) > $tmp/i$i.h
+done
+echo 'int last;' > $tmp/i300.h
+same -fmax-include-depth=300 $tmp/i1.h
+check "#include nested 300 deep"
+$prep $tmp/i1.h 2>&1 > /dev/null | grep -q "exceeds maximum of 200"
+check "-fmax-include-depth default"
@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# parallel.sh prep: -fparallel-includes and -fconfig give the output of
+# plain runs while headers and the macros they see change.
+
+. `dirname $0`/lib.sh
+server_start
+
+# h.h is copied verbatim but depends on FOO
+printf 'int a;\nx FOO y\n' > $tmp/h.h
+printf '#include "h.h"\n#define FOO 1\n#include "h.h"\n' > $tmp/m.c
+diff <($prep $tmp/m.c) <($prep -fparallel-includes=2 $tmp/m.c)
+check "parallel includes in a cold run"
+$prep -fconfig="-DA -o $tmp/a.i" -fconfig="-DB -o $tmp/b.i" $tmp/m.c
+diff <($prep $tmp/m.c) $tmp/a.i && diff <($prep $tmp/m.c) $tmp/b.i
+check "configurations replaying a verbatim include"
+
+for i in 1 2 3; do
+    diff <($prep $tmp/m.c) <($prep --client $tmp/sock -fparallel-includes=2 \
+        $tmp/m.c)
+    check "parallel includes in request $i"
+    sleep 1 # a new mtime
+    printf 'int a%d;\nx FOO y\n#define FOO %d\n' $i $i > $tmp/h.h
+done
+
+# a worker changing other macros than predicted makes the run start over,
+# which is counted and traced once
+printf 'int a;\n#define FOO 1\n' > $tmp/h.h
+printf '#include "h.h"\nFOO\n' > $tmp/m.c
+expands() {
+    $prep "$@" -ftime-trace=$tmp/trace.json -ftime-trace-granularity=0 \
+        $tmp/m.c > /dev/null
+    grep -c '"expand"' $tmp/trace.json
+}
+expands --client $tmp/sock -fparallel-includes=2 > /dev/null
+sleep 1
+printf 'int b;\n#define FOO 2\n#define BAR 3\n' > $tmp/h.h
+[[ `expands --client $tmp/sock -fparallel-includes=2` == `expands` ]]
+check "parallel includes starting over"
@@ -0,0 +1,16 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# paste.sh prep: ## warns only when the result is not one preprocessing
+# token.
+
+. `dirname $0`/lib.sh
+
+[[ -z `$prep test/number.h 2>&1 > /dev/null` ]]
+check "pastes giving pp-numbers"
+
+printf '#define CAT(a, b) a##b\nCAT(+, /) CAT(1, "s")\n' > $tmp/m.c
+[[ `$prep $tmp/m.c 2>&1 > /dev/null | grep -c "does not give"` == 2 ]]
+check "pastes giving no token"
@@ -0,0 +1,21 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# profile.sh prep: -fmacro-profile reports the depth of the deepest
+# expansion each macro was part of.
+
+. `dirname $0`/lib.sh
+
+printf '#define A(x) x\n#define B A(1)\n#define C B\nC\n' > $tmp/m.c
+depth() {
+    $prep -fmacro-profile $tmp/m.c 2>&1 > /dev/null |
+        awk -v m=$1 '$1 == m { print $4 }'
+}
+[[ `depth C` == 1 && `depth B` == 2 && `depth A` == 3 ]]
+check "depth of nested expansions"
+
+printf '#define A(x) x\nA(A(A(1)))\n' > $tmp/m.c
+[[ `depth A` == 3 ]]
+check "depth of expansions in arguments"
@@ -0,0 +1,34 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# server.sh prep: requests through --server give the output of local runs,
+# and repeated requests replay the tokens lexed before.
+
+. `dirname $0`/lib.sh
+server_start
+
+for file in test/*.h; do
+    diff <($prep $file 2>&1) <($prep --client $tmp/sock $file 2>&1)
+    check "server $file"
+done
+
+stat "tokens replayed" --client $tmp/sock test/include.h > /dev/null
+[[ `stat "tokens replayed" --client $tmp/sock test/include.h` -gt 0 ]]
+check "server replays tokens of a second request"
+
+# a request failing inside a #define does not leave the next one mid-line
+printf '#define BAD "abc\n' > $tmp/bad.h
+printf '#pragma once\n#define X 1\nX\n' > $tmp/ok.h
+$prep --client $tmp/sock $tmp/bad.h 2> /dev/null
+diff <($prep $tmp/ok.h) <($prep --client $tmp/sock $tmp/ok.h)
+check "server request after a failed one"
+
+# an identical redefinition keeps the first one, as in local runs
+printf '#define X 1\n' > $tmp/x.h
+printf '#include "x.h"\n#define X 1\nX\n' > $tmp/redef.h
+$prep -ftoken-stream -o $tmp/local.ts $tmp/redef.h
+$prep --client $tmp/sock -ftoken-stream -o $tmp/server.ts $tmp/redef.h
+diff <(./tokread -v $tmp/local.ts) <(./tokread -v $tmp/server.ts)
+check "server keeps the first of identical definitions"
@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# snapshot.sh prep: -include-snapshot gives the output of preprocessing the
+# prefix header in front of the file, and refuses gcc's -include.
+
+. `dirname $0`/lib.sh
+
+cat > $tmp/pre.h << 'END'
+#ifndef PRE_H
+#define PRE_H
+#define N 3
+#define ADD(a, b) ((a) + (b))
+#define EMPTY
+#define GONE 1
+#undef GONE
+#define UNUSED(x) x x x
+int pre;
+#endif
+END
+cat > $tmp/m.c << 'END'
+#include "pre.h"
+int a = ADD(N, 1) EMPTY;
+#ifdef GONE
+int gone;
+#endif
+END
+cat $tmp/pre.h $tmp/m.c > $tmp/all.c
+$prep -fsnapshot=$tmp/pre.snap $tmp/pre.h > /dev/null
+diff -w -B <($prep $tmp/all.c) <($prep -include-snapshot $tmp/pre.snap $tmp/m.c)
+check "snapshot round trip"
+
+# tokens of macros stay in the snapshot until they are used
+: > $tmp/empty.c
+[[ `stat tokens -include-snapshot $tmp/pre.snap $tmp/empty.c` -le 2 ]]
+check "snapshot tokens made on use"
+
+sleep 1 # a new mtime
+sed -i 's/define N 3/define N 4/' $tmp/pre.h
+cat $tmp/pre.h $tmp/m.c > $tmp/all.c
+diff -w -B <($prep $tmp/all.c) \
+    <($prep -include-snapshot $tmp/pre.snap $tmp/m.c 2> /dev/null)
+check "stale snapshot"
+
+$prep -include $tmp/pre.h $tmp/m.c 2>&1 | grep -q "Unknown option"
+check "-include refused"
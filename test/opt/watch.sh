@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Tiny C Preprocessor
+# Copyright (c) 2025 mzuhi5
+#
+# watch.sh prep: --watch writes file.i next to each file and rewrites it
+# when a file it opened changes.
+
+. `dirname $0`/lib.sh
+
+mkdir $tmp/x.d
+printf '#define N 1\n' > $tmp/x.d/h.h
+printf '#include "h.h"\nint m = N;\n' > $tmp/x.d/m
+printf 'int i;\n' > $tmp/i.i
+cd $tmp
+# waits until file has the output of a plain run of src
+wait_for() {
+    for n in {1..50}; do
+        diff -q $1 <($prep $2) > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    return 1
+}
+$prep --watch ./x.d/m i.i 2> $tmp/log &
+trap "kill $!; rm -rf $tmp" EXIT
+
+wait_for x.d/m.i x.d/m
+check "output next to a file in a dotted dir"
+
+printf '#define N 2\n' > x.d/h.h
+wait_for x.d/m.i x.d/m
+check "output rewritten after a header changed"
+
+grep -q "overwrite the input: i.i" $tmp/log && [[ `cat i.i` == "int i;" ]]
+check "input named .i kept"
@@ -0,0 +1,6 @@
+#define N 4
+#pragma pack(push, 1)
+struct s { char c; int a[N]; };
+#pragma pack(pop)
+#pragma GCC diagnostic ignored "-Wall"
+int n = N;
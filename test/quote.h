@@ -0,0 +1,6 @@
+#define Q(x) x
+char bs = '\\';
+char q = '\'';
+char *s = "\\";
+char *t = "\\\"\\";
+Q('\\') Q("\\") Q('"') Q("'")
@@ -0,0 +1,16 @@
+// lines copied as they are until a name on them becomes a macro
+int a = b + c;
+char *s = "a b c";
+#define a 1
+int a = b + c;
+char *s = "a b c";
+#define F(x) [x]
+int F = F;
+int g = F (b);
+#define c F(c)
+int a = b + c;
+#undef a
+int a = b + c;
+#define b 'b'
+int a = b + c, e = 1e5, p = .5;
+int u = __LINE__;
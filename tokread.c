@@ -0,0 +1,59 @@
+/*
+ * Tiny C Preprocessor
+ * Copyright (c) 2025 mzuhi5
+ *
+ * Reader of prep -ftoken-stream output: prints the tokens as text, or one
+ * record per line with -v.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tokstream.h"
+
+int main(int ac, char **av) {
+    int verbose = ac > 2 && strcmp(av[1], "-v") == 0;
+    if (ac != 2 + verbose) {
+        fprintf(stderr, "usage: %s [-v] file\n", av[0]);
+        return 2;
+    }
+    int fd = open(av[1 + verbose], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(TokHeader)) {
+        fprintf(stderr, "Can not read file: %s\n", av[1 + verbose]);
+        return 1;
+    }
+    TokHeader *h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (h == MAP_FAILED || memcmp(h->magic, TOKSTREAM_MAGIC, 8) != 0 ||
+        tok_bytes(h) + h->nbytes != (char *)h + st.st_size) {
+        fprintf(stderr, "Not a token stream: %s\n", av[1 + verbose]);
+        return 1;
+    }
+
+    TokRec *r = tok_recs(h);
+    TokStr *strs = tok_strs(h);
+    unsigned *files = tok_files(h);
+    char *bytes = tok_bytes(h);
+    for (unsigned i = 0; i < h->nrecs; i++, r++) {
+        TokStr s = strs[r->str];
+        if (!verbose) {
+            printf("%s", r->leading ? " " : "");
+            for (int n = 1; n < r->leading; n++) {
+                printf("\\\n "); // line continued in the whitespace
+            }
+            printf("%.*s", s.len, bytes + s.off);
+        } else if (r->line) {
+            TokStr f = strs[files[r->file]];
+            printf("%.*s:%u: %d %d %.*s\n", f.len, bytes + f.off, r->line,
+                   r->kind, r->leading, s.len, bytes + s.off);
+        } else {
+            printf("-: %d %d %.*s\n", r->kind, r->leading, s.len,
+                   bytes + s.off);
+        }
+    }
+    return 0;
+}
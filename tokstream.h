@@ -0,0 +1,64 @@
+/*
+ * Tiny C Preprocessor
+ * Copyright (c) 2025 mzuhi5
+ *
+ * Layout of the token stream written by prep -ftoken-stream. The file is
+ * the header followed by the sections in this order, all 4-byte aligned, so
+ * it can be mmapped and iterated in place.
+ */
+
+#define TOKSTREAM_MAGIC "PREPTOK1"
+
+typedef enum {
+    TOK_SPACES,
+    TOK_NEWLINE,
+    TOK_DIRECTIVE, // # of a directive passed through, as #pragma
+    TOK_IDENT,
+    TOK_NUM,       // pp-number
+    TOK_PUNCT,
+    TOK_CHAR,      // spelling with its quotes
+    TOK_STRING,    // spelling with its quotes
+    TOK_USR_HEADER,
+    TOK_SYS_HEADER,
+    TOK_VERBATIM,  // source line copied as it is
+    TOK_EOF,
+} TokKind;
+
+typedef struct {
+    char magic[8];
+    unsigned nrecs;  // TokRec records
+    unsigned nstrs;  // TokStr entries of unique spellings and file paths
+    unsigned nfiles; // string index of each file path
+    unsigned nbytes; // bytes of strings, not terminated
+} TokHeader;
+
+typedef struct {
+    unsigned char kind;    // TokKind
+    unsigned char leading; // whitespace before the token: 0 if none, else 1
+                           // + its backslash-newlines, at most 255
+    unsigned short pad;
+    unsigned str;  // spelling as printed, literals with their quotes
+    unsigned file; // index of files, where the spelling comes from
+    unsigned line; // 0 for tokens prep made
+} TokRec;
+
+typedef struct {
+    unsigned off; // in bytes
+    unsigned len;
+} TokStr;
+
+static inline TokRec *tok_recs(TokHeader *h) {
+    return (TokRec *)(h + 1);
+}
+
+static inline TokStr *tok_strs(TokHeader *h) {
+    return (TokStr *)(tok_recs(h) + h->nrecs);
+}
+
+static inline unsigned *tok_files(TokHeader *h) {
+    return (unsigned *)(tok_strs(h) + h->nstrs);
+}
+
+static inline char *tok_bytes(TokHeader *h) {
+    return (char *)(tok_files(h) + h->nfiles);
+}